@@ -0,0 +1,119 @@
+#!/usr/bin/env python3
+"""Encode an animation for the DM163 driver as the channels streams it
+shifts out, so that the driver replays it from flash as it is.
+
+The animation is described in JSON:
+
+    {
+      "loop": false,
+      "frames": [
+        {"duration_ms": 50, "rows": ["ff0000 000000 ...", ...]},
+        ...
+      ]
+    }
+
+Each row lists the colors of its LEDs as RRGGBB, 8 per DM163 of the chain.
+The gamma curve and calibrations are those of the driver, see
+gen_dm163_luts.py.
+"""
+
+import argparse
+import json
+
+from gen_dm163_luts import CURVES, channel_lut
+
+CHIP_CHANNELS = 24
+CHANNEL_BITS = 8
+
+
+def parse_row(row):
+    channels = []
+    for color in row.split():
+        if len(color) != 6:
+            raise ValueError(f"{color} is not a RRGGBB color")
+        channels += bytes.fromhex(color)
+    if not channels or len(channels) % CHIP_CHANNELS:
+        raise ValueError(f"{row!r} does not cover whole DM163s")
+    return channels
+
+
+def encode_row(channels, luts):
+    """Same as encode_bank() in dm163.c: last channel first, MSB first."""
+    stream = bytearray(len(channels) * CHANNEL_BITS // 8)
+    bit = 0
+    for i in reversed(range(len(channels))):
+        value = luts[i % 3][channels[i]]
+        for b in reversed(range(CHANNEL_BITS)):
+            if (value >> b) & 1:
+                stream[bit // 8] |= 0x80 >> (bit % 8)
+            bit += 1
+    return stream
+
+
+def c_bytes(data, indent):
+    return "\n".join(
+        indent + ", ".join(f"0x{b:02x}" for b in data[i:i + 12]) + ","
+        for i in range(0, len(data), 12))
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description=__doc__,
+        formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("input")
+    parser.add_argument("--name", required=True,
+                        help="name of the struct dm163_animation")
+    parser.add_argument("--gamma", choices=CURVES, default="linear")
+    parser.add_argument("--calibration", type=int, nargs=3,
+                        metavar=("RED", "GREEN", "BLUE"), default=[100] * 3)
+    parser.add_argument("--output", required=True)
+    args = parser.parse_args()
+
+    with open(args.input) as f:
+        animation = json.load(f)
+
+    luts = [channel_lut(CURVES[args.gamma], calibration)
+            for calibration in args.calibration]
+    frames = animation["frames"]
+    if not frames:
+        parser.error("the animation has no frames")
+
+    streams = []
+    for index, frame in enumerate(frames):
+        rows = [parse_row(row) for row in frame["rows"]]
+        if len(rows) != len(frames[0]["rows"]) or \
+                any(len(row) != len(rows[0]) for row in rows):
+            parser.error(f"frame {index} does not have the size of frame 0")
+        streams.append(b"".join(encode_row(row, luts) for row in rows))
+    num_rows = len(frames[0]["rows"])
+    stream_size = len(streams[0]) // num_rows
+
+    body = "\n".join(f"    // frame {i}\n{c_bytes(stream, ' ' * 4)}"
+                     for i, stream in enumerate(streams))
+    durations = ", ".join(str(frame["duration_ms"]) for frame in frames)
+
+    with open(args.output, "w") as output:
+        output.write(f"""\
+// Generated by gen_dm163_animation.py from {args.input.split('/')[-1]},
+// do not edit.
+#include "dm163.h"
+
+static const uint8_t {args.name}_streams[] = {{
+{body}
+}};
+
+static const uint16_t {args.name}_durations_ms[] = {{{durations}}};
+
+const struct dm163_animation {args.name} = {{
+    .streams = {args.name}_streams,
+    .durations_ms = {args.name}_durations_ms,
+    .num_frames = {len(frames)},
+    .num_rows = {num_rows},
+    .stream_size = {stream_size},
+    .loop = {"true" if animation.get("loop", False) else "false"},
+}};
+""")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,101 @@
+#!/usr/bin/env python3
+"""Generate the lookup tables applied by the DM163 driver when it encodes
+the banks of a frame.
+
+- dm163_channel_lut[3][256]: red, green and blue channel values after the
+  gamma curve and the calibration of each color.
+- dm163_brightness_lut[101]: LED API brightness, in percent, to the 6-bit
+  dot correction of the DM163.
+"""
+
+import argparse
+
+CHANNEL_MAX = 255
+BRIGHTNESS_MAX = 63
+
+
+def gamma_linear(x):
+    return x
+
+
+def gamma_2_2(x):
+    return x**2.2
+
+
+def gamma_cie1931(x):
+    # Lightness L* in [0, 1] to relative luminance
+    lightness = x * 100
+    if lightness <= 8:
+        return lightness / 903.3
+    return ((lightness + 16) / 116) ** 3
+
+
+CURVES = {
+    "linear": gamma_linear,
+    "2.2": gamma_2_2,
+    "cie1931": gamma_cie1931,
+}
+
+
+def channel_lut(curve, calibration):
+    return [
+        round(CHANNEL_MAX * curve(value / CHANNEL_MAX) * calibration / 100)
+        for value in range(CHANNEL_MAX + 1)
+    ]
+
+
+def brightness_lut():
+    return [round(BRIGHTNESS_MAX * percent / 100) for percent in range(101)]
+
+
+def c_array(values, indent):
+    lines = []
+    for i in range(0, len(values), 12):
+        row = ", ".join(f"{v:3d}" for v in values[i:i + 12])
+        lines.append(f"{indent}{row},")
+    return "\n".join(lines)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("--gamma", choices=CURVES, default="linear")
+    parser.add_argument("--calibration", type=int, nargs=3,
+                        metavar=("RED", "GREEN", "BLUE"), default=[100] * 3,
+                        help="full scale of each color, in percent")
+    parser.add_argument("--output", required=True)
+    args = parser.parse_args()
+
+    for calibration in args.calibration:
+        if not 0 <= calibration <= 100:
+            parser.error("calibrations must be between 0 and 100")
+
+    curve = CURVES[args.gamma]
+    colors = ("red", "green", "blue")
+    tables = "\n".join(
+        f"    // {color}, {calibration}%\n"
+        f"    {{\n{c_array(channel_lut(curve, calibration), ' ' * 8)}\n    }},"
+        for color, calibration in zip(colors, args.calibration))
+
+    with open(args.output, "w") as header:
+        header.write(f"""\
+// Generated by {__file__.split('/')[-1]}, do not edit.
+// Gamma curve: {args.gamma}
+#ifndef DM163_LUTS_H
+#define DM163_LUTS_H
+
+#include <stdint.h>
+
+static const uint8_t dm163_channel_lut[3][{CHANNEL_MAX + 1}] = {{
+{tables}
+}};
+
+static const uint8_t dm163_brightness_lut[101] = {{
+{c_array(brightness_lut(), ' ' * 4)}
+}};
+
+#endif
+""")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,125 @@
+/*
+ * Benchmark of the write paths of the DM163 driver against its emulator.
+ * Each benchmark prints a key=value line in the format of the
+ * "dm163 bench" shell command, so that runs can be compared from the logs.
+ * Cycles only advance with the simulated time on native_sim, so only the
+ * GPIO calls per operation are reported and checked here. They are the
+ * same on hardware, where "dm163 bench" also gives the cycles.
+ */
+#include <string.h>
+
+#include <zephyr/device.h>
+#include <zephyr/kernel.h>
+#include <zephyr/ztest.h>
+
+#include "dm163.h"
+#include "dm163_emul.h"
+
+#define ITERATIONS 50
+
+#define DM163_NODE DT_NODELABEL(dm163)
+#define CHAIN_CHANNELS (DT_PROP(DM163_NODE, chain_length) * DM163_CHIP_LEDS * 3)
+#define HAS_ROWS DT_NODE_HAS_PROP(DM163_NODE, rgb_matrix)
+#define NUM_ROWS                                                         \
+  COND_CODE_1(HAS_ROWS,                                                  \
+              (DT_PROP_LEN(DT_PHANDLE(DM163_NODE, rgb_matrix), rows_gpios)), \
+              (1))
+
+/*
+ * GPIO calls of shifting out a bank of `bits` bits: a single transfer with
+ * SPI, otherwise two port writes per bit and one to bring GCK back low, as
+ * SIN and GCK share gpio0
+ */
+#define SHIFT_CALLS(bits) \
+  (DT_NODE_HAS_PROP(DM163_NODE, spi) ? 1 : 2 * (bits) + 1)
+// Shifting the channels or the brightness out, LAT pulsed and SELBK
+// toggled around the brightness
+#define CHANNELS_CALLS (SHIFT_CALLS(CHAIN_CHANNELS * 8) + 2)
+#define BRIGHTNESS_CALLS (SHIFT_CALLS(CHAIN_CHANNELS * 6) + 4)
+// Rows also turn the previous row off and the next one on
+#define ROW_CALLS (CHANNELS_CALLS + 2)
+
+// Value of the brightness of led_set_brightness(), in percent, in the
+// 6-bit dot correction bank
+#define DOT_CORRECTION(percent) ((63 * (percent) + 50) / 100)
+
+static const struct device *const dm163_dev = DEVICE_DT_GET(DM163_NODE);
+
+static uint8_t channels[NUM_ROWS * CHAIN_CHANNELS];
+static uint8_t brightness[CHAIN_CHANNELS];
+
+static void print_result(const struct dm163_bench_result *result) {
+  TC_PRINT("dm163_bench name=%s ops=%u gpio_calls_per_op=%u\n", result->name,
+           result->ops, result->gpio_calls / result->ops);
+}
+
+/*
+ * GPIO calls of each operation of the benchmark. Every operation changes
+ * the frame. Without rows, only the bank it changes is flushed. When
+ * scanning, the benchmark shifts out all the rows after each operation,
+ * and the brightness along with the first row when it changed.
+ */
+static uint32_t expected_calls(const char *name) {
+  bool brightness_op = strcmp(name, "brightness") == 0;
+
+  if (HAS_ROWS) {
+    return NUM_ROWS * ROW_CALLS + (brightness_op ? BRIGHTNESS_CALLS : 0);
+  }
+  return brightness_op ? BRIGHTNESS_CALLS : CHANNELS_CALLS;
+}
+
+ZTEST(dm163_benchmark, test_write_paths) {
+  struct dm163_bench_result results[DM163_BENCH_COUNT];
+  struct dm163_emul_stats stats;
+
+  zassert_true(device_is_ready(dm163_dev), "DM163 not ready");
+  zassert_ok(dm163_emul_reset_stats(dm163_dev));
+  zassert_ok(dm163_benchmark(dm163_dev, ITERATIONS, results));
+
+  for (int b = 0; b < DM163_BENCH_COUNT; b++) {
+    uint32_t expected = expected_calls(results[b].name);
+
+    print_result(&results[b]);
+    zassert_equal(results[b].ops, ITERATIONS, "%s stopped early",
+                  results[b].name);
+    zassert_equal(results[b].gpio_calls, ITERATIONS * expected,
+                  "%s made %u GPIO calls instead of %u per operation",
+                  results[b].name, results[b].gpio_calls / ITERATIONS,
+                  expected);
+  }
+
+  /*
+   * The refresh comes last and sets every LED to the color of its last
+   * iteration, then the brightness benchmark left 6% on the first LED.
+   * The LUTs are linear.
+   */
+  zassert_ok(dm163_emul_get_channels(dm163_dev, channels, sizeof(channels)));
+  for (int i = 0; i < ARRAY_SIZE(channels); i += 3) {
+    uint8_t last = ITERATIONS - 1;
+    const uint8_t color[3] = {last, ~last & 0xff, 0x80};
+
+    zassert_mem_equal(&channels[i], color, sizeof(color),
+                      "LED %d was not latched", i / 3);
+  }
+  zassert_ok(
+      dm163_emul_get_brightness(dm163_dev, brightness, sizeof(brightness)));
+  for (int i = 0; i < ARRAY_SIZE(brightness); i++) {
+    zassert_equal(brightness[i], DOT_CORRECTION(i < 3 ? 6 : 100),
+                  "brightness of channel %d is %u", i, brightness[i]);
+  }
+
+  zassert_ok(dm163_emul_get_stats(dm163_dev, &stats));
+  TC_PRINT("dm163_emul channels_latches=%u brightness_latches=%u "
+           "gck_edges=%llu\n",
+           stats.channels_latches, stats.brightness_latches,
+           (unsigned long long)stats.gck_edges);
+  // Each row of each operation, or each operation but the brightness one
+  zassert_true(stats.channels_latches >=
+                   ITERATIONS * (HAS_ROWS ? DM163_BENCH_COUNT * NUM_ROWS
+                                          : DM163_BENCH_COUNT - 1),
+               "the channels were not latched");
+  zassert_true(stats.brightness_latches >= ITERATIONS,
+               "the brightness was not latched");
+}
+
+ZTEST_SUITE(dm163_benchmark, NULL, NULL, NULL, NULL, NULL);
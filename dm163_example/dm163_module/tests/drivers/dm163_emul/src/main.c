@@ -0,0 +1,88 @@
+/*
+ * Decoding of the DM163 emulator: the banks written through the LED API
+ * must be latched by the emulated chain as the driver encoded them, after
+ * the linear LUTs of the default Kconfig options, with one GCK edge per
+ * bit of the chain in each flush.
+ */
+#include <zephyr/device.h>
+#include <zephyr/drivers/led.h>
+#include <zephyr/kernel.h>
+#include <zephyr/ztest.h>
+
+#include "dm163.h"
+#include "dm163_emul.h"
+
+#define DM163_NODE DT_NODELABEL(dm163)
+#define CHAIN_LENGTH DT_PROP(DM163_NODE, chain_length)
+#define NUM_LEDS (CHAIN_LENGTH * DM163_CHIP_LEDS)
+#define NUM_CHANNELS (NUM_LEDS * 3)
+
+// GCK edges of a flush of each bank of a single DM163
+#define CHIP_CHANNELS_EDGES (DM163_CHIP_LEDS * 3 * 8)
+#define CHIP_BRIGHTNESS_EDGES (DM163_CHIP_LEDS * 3 * 6)
+
+// Value of the brightness of led_set_brightness(), in percent, in the
+// 6-bit dot correction bank
+#define DOT_CORRECTION(percent) ((63 * (percent) + 50) / 100)
+
+static const struct device *const dm163_dev = DEVICE_DT_GET(DM163_NODE);
+
+static uint8_t written[NUM_CHANNELS];
+static uint8_t latched[NUM_CHANNELS];
+
+static void check_last_flush(bool brightness, uint32_t chip_edges) {
+  struct dm163_emul_stats stats;
+
+  zassert_ok(dm163_emul_get_stats(dm163_dev, &stats));
+  zassert_equal(stats.last.brightness, brightness, "wrong bank latched");
+  zassert_equal(stats.last.gck_edges, CHAIN_LENGTH * chip_edges,
+                "%u GCK edges instead of %u", stats.last.gck_edges,
+                CHAIN_LENGTH * chip_edges);
+  zassert_equal(stats.last.bytes, CHAIN_LENGTH * chip_edges / 8,
+                "%u bytes shifted in", stats.last.bytes);
+}
+
+ZTEST(dm163_emul, test_channels) {
+  zassert_true(device_is_ready(dm163_dev), "DM163 not ready");
+
+  // Different values on every channel, so that a misplaced one shows
+  for (int i = 0; i < NUM_CHANNELS; i++) written[i] = i * 37 + 11;
+  zassert_ok(led_write_channels(dm163_dev, 0, NUM_CHANNELS, written));
+
+  zassert_ok(dm163_emul_get_channels(dm163_dev, latched, sizeof(latched)));
+  zassert_mem_equal(latched, written, sizeof(written),
+                    "latched channels differ from the written ones");
+  check_last_flush(false, CHIP_CHANNELS_EDGES);
+
+  // A single channel flushes the whole chain again.
+  written[NUM_CHANNELS - 1] ^= 0xff;
+  zassert_ok(led_write_channels(dm163_dev, NUM_CHANNELS - 1, 1,
+                                &written[NUM_CHANNELS - 1]));
+  zassert_ok(dm163_emul_get_channels(dm163_dev, latched, sizeof(latched)));
+  zassert_mem_equal(latched, written, sizeof(written),
+                    "latched channels differ from the written ones");
+  check_last_flush(false, CHIP_CHANNELS_EDGES);
+}
+
+ZTEST(dm163_emul, test_brightness) {
+  zassert_true(device_is_ready(dm163_dev), "DM163 not ready");
+
+  // Every LED below the 100% set at init
+  for (int led = 0; led < NUM_LEDS; led++) {
+    zassert_ok(led_set_brightness(dm163_dev, led, led * 13 % 100));
+    check_last_flush(true, CHIP_BRIGHTNESS_EDGES);
+  }
+
+  zassert_ok(dm163_emul_get_brightness(dm163_dev, latched, sizeof(latched)));
+  for (int i = 0; i < NUM_CHANNELS; i++) {
+    zassert_equal(latched[i], DOT_CORRECTION(i / 3 * 13 % 100),
+                  "brightness of channel %d is %u", i, latched[i]);
+  }
+}
+
+static void reset_stats(void *fixture) {
+  ARG_UNUSED(fixture);
+  dm163_emul_reset_stats(dm163_dev);
+}
+
+ZTEST_SUITE(dm163_emul, NULL, NULL, reset_stats, NULL, NULL);
@@ -7,8 +7,16 @@
 #include <zephyr/device.h>
 #include <zephyr/drivers/gpio.h>
 #include <zephyr/drivers/led.h>
+#include <zephyr/drivers/pwm.h>
+#include <zephyr/drivers/spi.h>
 #include <zephyr/kernel.h>
 #include <zephyr/logging/log.h>
+#ifdef CONFIG_DM163_DIRECT_PORT_WRITES
+#include <soc.h>
+#endif
+
+// Generated at build time from the gamma and calibration Kconfig options
+#include "dm163_luts.h"
 
 LOG_MODULE_REGISTER(dm163, LOG_LEVEL_DBG);
 
@@ -19,18 +27,259 @@ struct dm163_config {
   const struct gpio_dt_spec rst;
   const struct gpio_dt_spec selbk;
   const struct gpio_dt_spec sin;
+#ifdef CONFIG_DM163_DIRECT_PORT_WRITES
+  // Registers of the STM32 ports of SIN and GCK, NULL if a pin is missing
+  // or sits on another kind of GPIO controller
+  GPIO_TypeDef *sin_regs;
+  GPIO_TypeDef *gck_regs;
+#endif
+#ifdef CONFIG_DM163_DRIVER_PWM
+  // PWM driving EN instead of en-gpios, no device if the instance has none
+  const struct pwm_dt_spec en_pwm;
+#endif
+#ifdef CONFIG_DM163_DRIVER_SPI
+  // SPI controller wired to SIN/GCK, NULL if the instance has none
+  const struct device *spi;
+  struct spi_config spi_config;
+#endif
+  // Rows of the rgb_matrix scanned by this DM163, NULL if the channels
+  // drive the LEDs directly
+  const struct gpio_dt_spec *rows;
+  // Number of rows of the framebuffer, 1 when there is no rgb_matrix
+  uint8_t num_rows;
+  // Number of daisy-chained DM163s and of channels of the whole chain
+  uint8_t chain_length;
+  uint16_t num_channels;
+  // Banks of the 3 frames, frame_size bytes each
+  uint8_t *frame_banks;
+  size_t frame_size;
+  // Banks packed in the order they are shifted out on SIN, with one
+  // channels stream per row, kept from one refresh to the next
+  uint8_t *brightness_stream;
+  uint8_t *channels_stream;
+#ifdef CONFIG_DM163_SCAN_DITHER
+  // Channels of the row being scanned, once dithered
+  uint8_t *dither_row;
+#endif
+#ifdef CONFIG_DM163_SCAN
+  k_thread_stack_t *scan_stack;
+  size_t scan_stack_size;
+#endif
 };
 
-#define NUM_LEDS 8
-#define NUM_CHANNELS (NUM_LEDS * 3)
+// LEDs and channels of a single DM163 of the chain
+#define CHIP_LEDS DM163_CHIP_LEDS
+#define CHIP_CHANNELS (CHIP_LEDS * 3)
 
-struct dm163_data {
-  uint8_t brightness[NUM_CHANNELS];
-  uint8_t channels[NUM_CHANNELS];
-  struct k_mutex flush_mutex;
+// Width in bits of a channel in each bank
+#define CHANNEL_BITS 8
+#define BRIGHTNESS_BITS 6
+
+// Bits of the channels below the CHANNEL_BITS shifted out, shown by
+// temporal dithering when scanning
+#ifdef CONFIG_DM163_SCAN_DITHER
+#define DITHER_BITS CONFIG_DM163_SCAN_DITHER_BITS
+#else
+#define DITHER_BITS 0
+#endif
+// Banks of a frame for each row: the channels, and their fractions
+#define ROW_BANKS (DITHER_BITS > 0 ? 2 : 1)
+
+// Size of the bitstreams shifted out on SIN for each bank of a chain of
+// n DM163s
+#define CHANNELS_STREAM_SIZE(n) ((n) * CHIP_CHANNELS * CHANNEL_BITS / 8)
+#define BRIGHTNESS_STREAM_SIZE(n) ((n) * CHIP_CHANNELS * BRIGHTNESS_BITS / 8)
+
+// The SPI path only sends whole bytes.
+BUILD_ASSERT(CHIP_CHANNELS * CHANNEL_BITS % 8 == 0);
+BUILD_ASSERT(CHIP_CHANNELS * BRIGHTNESS_BITS % 8 == 0);
+
+/*
+ * Raw port words written on each edge when replaying a bitstream on the
+ * sin/gck GPIOs, precomputed at init so that the pin polarities are applied
+ * only once. Each edge is a single gpio_port_set_clr_bits_raw() call, which
+ * never reads the port back.
+ */
+struct dm163_port_words {
+  // Pins set and cleared to put a 0 or a 1 on SIN. When SIN and GCK share a
+  // port, they also bring GCK back to its idle level.
+  gpio_port_pins_t sin_set[2];
+  gpio_port_pins_t sin_clear[2];
+  // Pins set and cleared on the rising and falling edges of GCK
+  gpio_port_pins_t rise_set;
+  gpio_port_pins_t rise_clear;
+  gpio_port_pins_t fall_set;
+  gpio_port_pins_t fall_clear;
+  bool shared_port;
+#ifdef CONFIG_DM163_DIRECT_PORT_WRITES
+  // BSRR registers of the SIN and GCK ports, NULL to go through the GPIO
+  // API, and the words above as written to them: the pins to set in the
+  // low half, the pins to clear in the high half
+  volatile uint32_t *sin_bsrr;
+  volatile uint32_t *gck_bsrr;
+  uint32_t sin_word[2];
+  uint32_t rise_word;
+  uint32_t fall_word;
+#endif
 };
 
-static const struct gpio_dt_spec *row_to_turn_off;
+/*
+ * Everything shifted out to the DM163 chain. Frames are triple-buffered
+ * between the producers (the LED API) and the flush context (the scan
+ * thread, or the producer flushing when there is no rgb_matrix).
+ */
+struct dm163_frame {
+  // Number of the publication of this frame
+  uint32_t seq;
+  // Range of the banks where this frame is behind the latest published
+  // one, empty when stale_start == stale_end. Only used by the producers.
+  size_t stale_start;
+  size_t stale_end;
+  // The brightness bank followed by one channels bank per row of the
+  // rgb_matrix then, with dithering, one fractions bank per row, each
+  // num_channels long. See frame_banks in the config.
+  uint8_t *banks;
+};
+
+#define DIRTY_CHANNELS BIT(0)
+#define DIRTY_BRIGHTNESS BIT(1)
+
+/*
+ * Layout of frame_state: index of the latest complete frame, whether the
+ * flush context has not picked it up yet, and the banks it changes since
+ * the frame the flush context picked up last.
+ */
+#define FRAME_INDEX_MASK 0x3
+#define FRAME_FRESH BIT(2)
+#define FRAME_DIRTY_SHIFT 3
+
+/*
+ * States of a completion slot. A producer claims a free slot, fills it and
+ * arms it. Whoever moves an armed slot to FIRING, the flush context once
+ * the frame is latched or the producer if it was latched meanwhile, frees
+ * it and calls its callback, so the slots are shared without locks.
+ */
+#define COMPLETION_FREE 0
+#define COMPLETION_CLAIMED 1
+#define COMPLETION_ARMED 2
+#define COMPLETION_FIRING 3
+
+// Slot only used by synchronous calls, when the others are all taken
+#define SYNC_COMPLETION CONFIG_DM163_ASYNC_QUEUE_SIZE
+
+/*
+ * Callback waiting for the latch of a frame
+ */
+struct dm163_completion {
+  atomic_t state;
+  dm163_callback_t callback;
+  void *user_data;
+  // Sequence number of the frame holding the change
+  uint32_t seq;
+};
+
+#ifdef CONFIG_DM163_STATS
+/*
+ * Sum which would wrap on 32 bits, made of two atomics. It has a single
+ * writer, which makes high odd while it carries into it, so that readers
+ * can retry instead of seeing the low word wrapped without its carry.
+ */
+struct dm163_counter64 {
+  atomic_t low;
+  // Twice the high word, plus one while carrying
+  atomic_t high;
+};
+#endif
+
+struct dm163_data {
+  const struct device *dev;
+  struct dm163_frame frames[3];
+  // Latest complete frame, exchanged without locks with the flush context
+  atomic_t frame_state;
+  // Frame written by the producers
+  uint8_t back_frame;
+  // Frame shifted out by the flush context
+  uint8_t front_frame;
+  // Set while a producer flushes frames, when there is no scan
+  atomic_t flushing;
+  // Set at init if the SPI controller drives SIN/GCK
+  bool use_spi;
+  struct dm163_port_words port_words;
+  // Serializes the producers. It is never taken by the flush context.
+  struct k_spinlock producer_lock;
+  // Sequence number of the latest published frame
+  uint32_t published_seq;
+  // Sequence number of the latest frame latched by the flush context, and
+  // the error of the transfers which shifted it out, if any
+  atomic_t latched_seq;
+  atomic_t latched_status;
+  // Callbacks waiting for a frame to be latched, the last slot being kept
+  // for the synchronous calls
+  struct dm163_completion completions[CONFIG_DM163_ASYNC_QUEUE_SIZE + 1];
+  // Held by the synchronous call using the last slot
+  struct k_sem sync_slot;
+  atomic_t pending_completions;
+  // Flushes the frames on dm163_workq when there is no scan
+  struct k_work flush_work;
+  // Banks of the back frame changed since it was last published, and the
+  // range of the frame they span
+  uint8_t dirty;
+  size_t dirty_start;
+  size_t dirty_end;
+  // Number of nested dm163_begin_update() calls not yet committed
+  uint8_t update_depth;
+  atomic_t frames_dropped;
+  atomic_t frames_torn;
+#ifdef CONFIG_DM163_STATS
+  // Updated by the flush context without locking, see count_flush()
+  atomic_t flushes;
+  struct dm163_counter64 bytes;
+  atomic_t min_flush_cycles;
+  atomic_t max_flush_cycles;
+  struct dm163_counter64 total_flush_cycles;
+  // Updated by the producers
+  atomic_t skipped_writes;
+#endif
+#if defined(CONFIG_DM163_STATS) || defined(CONFIG_DM163_BENCHMARK)
+  // When producer_lock was taken, and the longest it has been held
+  uint32_t lock_start;
+  atomic_t max_lock_cycles;
+#endif
+#ifdef CONFIG_DM163_BENCHMARK
+  // GPIO calls, or SPI transfers, since the start of the benchmark
+  atomic_t gpio_calls;
+#endif
+#ifdef CONFIG_DM163_SCAN
+  // Row currently lit
+  uint8_t scan_row;
+  // Rows of the front frame whose channels stream is up to date, the rows
+  // being encoded in the order they are scanned. Always 0 with dithering,
+  // which changes the streams on each refresh.
+  uint8_t rows_encoded;
+  // Refresh of the matrix within the dithering cycle
+  uint8_t dither_phase;
+#ifdef CONFIG_DM163_ANIMATION
+  // Animation requested by the producers, NULL to show the frames
+  atomic_ptr_t animation;
+  // Animation shown by the scan, and where it is in it
+  const struct dm163_animation *playing;
+  uint16_t animation_frame;
+  uint32_t frame_refreshes;
+#endif
+  // Set when a row period of the frame being scanned was missed
+  bool scan_late;
+  struct k_timer scan_timer;
+  struct k_sem scan_sem;
+  struct k_thread scan_thread;
+#ifdef CONFIG_DM163_BENCHMARK
+  // Set by the benchmark to park the scan thread between two rows. The
+  // thread gives scan_parked once parked, and waits for scan_resume.
+  atomic_t scan_pause;
+  struct k_sem scan_parked;
+  struct k_sem scan_resume;
+#endif
+#endif
+};
 
 static int dm163_set_color(const struct device *dev, uint32_t led,
                            uint8_t num_colors, const uint8_t *color);
@@ -41,8 +290,149 @@ static int dm163_set_brightness(const struct device *dev, uint32_t led,
                                 uint8_t value);
 static int dm163_on(const struct device *dev, uint32_t led);
 static int dm163_off(const struct device *dev, uint32_t led);
-static void flush_brightness(const struct device *dev);
-static void flush_channels(const struct device *dev);
+static int flush_brightness(const struct device *dev,
+                             const struct dm163_frame *frame);
+static int flush_channels(const struct device *dev,
+                           const struct dm163_frame *frame);
+static void init_port_words(const struct device *dev);
+static bool update_bank(struct dm163_data *data, uint8_t *bank,
+                        uint32_t start, uint32_t count, const uint8_t *values,
+                        uint8_t dirty_flag);
+static bool arm_completion(struct dm163_data *data,
+                           struct dm163_completion *completion, uint32_t seq,
+                           dm163_callback_t callback, void *user_data);
+static void complete_latched(const struct device *dev, uint32_t seq,
+                             int status);
+static void publish_if_done(const struct device *dev);
+static void flush_frames(const struct device *dev);
+static void flush_work_handler(struct k_work *work);
+static int change_bank(const struct device *dev, size_t offset,
+                       uint32_t count, const uint8_t *values,
+                       const uint8_t *fractions, uint8_t dirty_flag,
+                       dm163_callback_t callback, void *user_data,
+                       uint32_t *seq);
+static int wait_flushed(const struct device *dev, uint32_t seq);
+#ifdef CONFIG_DM163_STATS
+static void count_flush(struct dm163_data *data, uint32_t bytes,
+                        uint32_t cycles);
+#endif
+#ifdef CONFIG_DM163_SCAN
+static int start_scan(const struct device *dev);
+static void scan_next_row(const struct device *dev);
+static k_timeout_t row_period(const struct device *dev);
+#endif
+
+/*
+ * Work queue flushing the frames of the asynchronous writes, shared by all
+ * the DM163 peripherals.
+ */
+static K_KERNEL_STACK_DEFINE(dm163_workq_stack, CONFIG_DM163_WORKQ_STACK_SIZE);
+static struct k_work_q dm163_workq;
+
+// Number of LEDs of a row, over the whole chain
+static inline uint32_t num_columns(const struct device *dev) {
+  const struct dm163_config *config = dev->config;
+
+  return config->chain_length * CHIP_LEDS;
+}
+
+// Number of LEDs addressed by the LED API, row after row
+static inline uint32_t num_leds(const struct device *dev) {
+  const struct dm163_config *config = dev->config;
+
+  return config->num_rows * num_columns(dev);
+}
+
+// Offset of the channels of a row in a frame, after the brightness bank
+static inline size_t channels_offset(const struct device *dev, uint32_t row) {
+  const struct dm163_config *config = dev->config;
+
+  return (row + 1) * config->num_channels;
+}
+
+// Offset of the fractions of the channels of a row, after all the channels
+static inline size_t fractions_offset(const struct device *dev,
+                                      uint32_t row) {
+  const struct dm163_config *config = dev->config;
+
+  return channels_offset(dev, config->num_rows + row);
+}
+
+#ifdef CONFIG_DM163_BENCHMARK
+#define COUNT_GPIO_CALLS(data, n) atomic_add(&(data)->gpio_calls, (n))
+#else
+#define COUNT_GPIO_CALLS(data, n)
+#endif
+
+#ifdef CONFIG_DM163_STATS
+static inline void counter64_add(struct dm163_counter64 *counter,
+                                 uint32_t value) {
+  uint32_t low = atomic_get(&counter->low);
+
+  if ((uint32_t)(low + value) >= low) {
+    atomic_set(&counter->low, (uint32_t)(low + value));
+    return;
+  }
+  atomic_inc(&counter->high);
+  atomic_set(&counter->low, (uint32_t)(low + value));
+  atomic_inc(&counter->high);
+}
+
+static inline uint64_t counter64_get(struct dm163_counter64 *counter) {
+  atomic_val_t high;
+  uint32_t low;
+
+  do {
+    high = atomic_get(&counter->high);
+    low = atomic_get(&counter->low);
+  } while ((high & 1) || atomic_get(&counter->high) != high);
+  return ((uint64_t)((uint32_t)high >> 1) << 32) | low;
+}
+
+static inline void counter64_clear(struct dm163_counter64 *counter) {
+  atomic_clear(&counter->high);
+  atomic_clear(&counter->low);
+}
+#endif
+
+#ifdef CONFIG_DM163_TRACE_HOOKS
+#define TRACE_FLUSH_START(dev, seq) dm163_trace_flush_start(dev, seq)
+#define TRACE_LATCH(dev, seq) dm163_trace_latch(dev, seq)
+#else
+#define TRACE_FLUSH_START(dev, seq)
+#define TRACE_LATCH(dev, seq)
+#endif
+
+#if defined(CONFIG_DM163_STATS) || defined(CONFIG_DM163_BENCHMARK)
+#define MEASURE_LOCK_HOLD 1
+#endif
+
+/*
+ * producer_lock locks the interrupts on a single core, where it can never
+ * be contended. How long it is held is measured instead, as it delays
+ * the interrupts and the other producers alike.
+ */
+static inline k_spinlock_key_t lock_producers(struct dm163_data *data) {
+  k_spinlock_key_t key = k_spin_lock(&data->producer_lock);
+
+#ifdef MEASURE_LOCK_HOLD
+  data->lock_start = k_cycle_get_32();
+#endif
+  return key;
+}
+
+static inline void unlock_producers(struct dm163_data *data,
+                                    k_spinlock_key_t key) {
+#ifdef MEASURE_LOCK_HOLD
+  uint32_t held = k_cycle_get_32() - data->lock_start;
+
+  // Only written with the lock held
+  if (held > (uint32_t)atomic_get(&data->max_lock_cycles)) {
+    atomic_set(&data->max_lock_cycles, held);
+  }
+#endif
+  k_spin_unlock(&data->producer_lock, key);
+}
 
 #define CONFIGURE_PIN(dt, flags)                           \
   do {                                                     \
@@ -56,36 +446,101 @@ static void flush_channels(const struct device *dev);
 static int dm163_init(const struct device *dev) {
   const struct dm163_config *config = dev->config;
   struct dm163_data *data = dev->data;
-  k_mutex_init(&data->flush_mutex);
+  static bool workq_started;
+  int ret;
 
   LOG_DBG("starting initialization of device %s", dev->name);
 
+  // Devices are initialized one after the other.
+  if (!workq_started) {
+    const struct k_work_queue_config workq_config = {.name = "dm163_workq"};
+
+    k_work_queue_init(&dm163_workq);
+    k_work_queue_start(&dm163_workq, dm163_workq_stack,
+                       K_KERNEL_STACK_SIZEOF(dm163_workq_stack),
+                       CONFIG_DM163_WORKQ_PRIORITY, &workq_config);
+    workq_started = true;
+  }
+  data->dev = dev;
+  k_work_init(&data->flush_work, flush_work_handler);
+#ifdef CONFIG_DM163_STATS
+  dm163_reset_stats(dev);
+#endif
+  k_sem_init(&data->sync_slot, 1, 1);
+
+#ifdef CONFIG_DM163_DRIVER_SPI
+  if (config->spi) {
+    data->use_spi = device_is_ready(config->spi);
+    if (!data->use_spi) {
+      LOG_WRN("SPI controller %s is not ready, falling back to GPIOs",
+              config->spi->name);
+    }
+  }
+#endif
+  if (!data->use_spi && (!config->sin.port || !config->gck.port)) {
+    LOG_ERR("device %s has no way to drive SIN/GCK", dev->name);
+    return -ENODEV;
+  }
+
   // Disable DM163 outputs while configuring if this pin
   // is connected.
   if (config->en.port) {
     CONFIGURE_PIN(&config->en, GPIO_OUTPUT_INACTIVE);
   }
+#ifdef CONFIG_DM163_DRIVER_PWM
+  if (config->en_pwm.dev) {
+    if (!pwm_is_ready_dt(&config->en_pwm)) {
+      LOG_ERR("device %s is not ready", config->en_pwm.dev->name);
+      return -ENODEV;
+    }
+    pwm_set_pulse_dt(&config->en_pwm, 0);
+  }
+#endif
   // Configure all pins. Make reset active so that the DM163
   // initiates a reset. We want the clock (gck) and latch (lat)
   // to be inactive at start. selbk will select bank 1 by default.
   CONFIGURE_PIN(&config->rst, GPIO_OUTPUT_ACTIVE);
-  CONFIGURE_PIN(&config->gck, GPIO_OUTPUT_INACTIVE);
   CONFIGURE_PIN(&config->lat, GPIO_OUTPUT_INACTIVE);
   CONFIGURE_PIN(&config->selbk, GPIO_OUTPUT_ACTIVE);
-  CONFIGURE_PIN(&config->sin, GPIO_OUTPUT);
+  // When the SPI controller drives SIN/GCK, the pins belong to it.
+  if (!data->use_spi) {
+    CONFIGURE_PIN(&config->gck, GPIO_OUTPUT_INACTIVE);
+    CONFIGURE_PIN(&config->sin, GPIO_OUTPUT);
+    init_port_words(dev);
+  }
   k_usleep(1);  // 100ns min
   // Cancel reset by making it inactive.
   gpio_pin_set_dt(&config->rst, 0);
 
-  memset(&data->brightness, 0x3f, sizeof(data->brightness));
-  memset(&data->channels, 0x00, sizeof(data->channels));
-  flush_brightness(dev);
-  flush_channels(dev);
+  for (int i = 0; i < ARRAY_SIZE(data->frames); i++) {
+    data->frames[i].banks = &config->frame_banks[i * config->frame_size];
+    memset(data->frames[i].banks, 100, config->num_channels);
+    memset(&data->frames[i].banks[channels_offset(dev, 0)], 0x00,
+           config->frame_size - config->num_channels);
+  }
+  data->front_frame = 0;
+  atomic_set(&data->frame_state, 1);
+  data->back_frame = 2;
+  ret = flush_brightness(dev, &data->frames[data->front_frame]);
+  if (!ret) ret = flush_channels(dev, &data->frames[data->front_frame]);
+  if (ret) return ret;
+
+#ifdef CONFIG_DM163_SCAN
+  if (config->rows) {
+    ret = start_scan(dev);
+    if (ret) return ret;
+  }
+#endif
 
   // Enable the outputs if this pin is connected.
   if (config->en.port) {
     gpio_pin_set_dt(&config->en, 1);
   }
+#ifdef CONFIG_DM163_DRIVER_PWM
+  if (config->en_pwm.dev) {
+    pwm_set_pulse_dt(&config->en_pwm, config->en_pwm.period);
+  }
+#endif
   LOG_INF("device %s initialized", dev->name);
   return 0;
 }
@@ -98,18 +553,112 @@ static const struct led_driver_api dm163_api = {
     .write_channels = dm163_write_channels,
 };
 
+// SPI controller of the DM163 peripheral with index i, or NULL if SIN/GCK
+// are only wired to GPIOs. The DM163 samples SIN on the rising edge of GCK,
+// which idles low: this is SPI mode 0.
+#define DM163_SPI_CONFIG(i)                                                  \
+  .spi = COND_CODE_1(DT_INST_NODE_HAS_PROP(i, spi),                          \
+                     (DEVICE_DT_GET(DT_INST_PHANDLE(i, spi))), (NULL)),      \
+  .spi_config = {                                                            \
+      .frequency = DT_INST_PROP(i, spi_max_frequency),                       \
+      .operation = SPI_OP_MODE_MASTER | SPI_TRANSFER_MSB | SPI_WORD_SET(8),  \
+  },
+
+// Registers of the STM32 port of the pin `prop` of the DM163 peripheral with
+// index i, or NULL if it has no such pin or another GPIO controller owns it
+#define DM163_PORT_REGS(i, prop)                                             \
+  COND_CODE_1(DT_INST_NODE_HAS_PROP(i, prop),                                \
+              (COND_CODE_1(DT_NODE_HAS_COMPAT(DT_INST_GPIO_CTLR(i, prop),    \
+                                              st_stm32_gpio),                \
+                           ((GPIO_TypeDef *)DT_REG_ADDR(                     \
+                               DT_INST_GPIO_CTLR(i, prop))),                 \
+                           (NULL))),                                         \
+              (NULL))
+
+#define DM163_DIRECT_CONFIG(i)                                               \
+  .sin_regs = DM163_PORT_REGS(i, sin_gpios),                                 \
+  .gck_regs = DM163_PORT_REGS(i, gck_gpios),
+
+#define DM163_HAS_MATRIX(i) DT_INST_NODE_HAS_PROP(i, rgb_matrix)
+#define DM163_MATRIX(i) DT_INST_PHANDLE(i, rgb_matrix)
+
+// Number of rows of the framebuffer of the DM163 peripheral with index i
+#define DM163_NUM_ROWS(i)                                                    \
+  COND_CODE_1(DM163_HAS_MATRIX(i),                                           \
+              (DT_PROP_LEN(DM163_MATRIX(i), rows_gpios)), (1))
+
+// Number of channels of the chain of the DM163 peripheral with index i
+#define DM163_NUM_CHANNELS(i) (DT_INST_PROP(i, chain_length) * CHIP_CHANNELS)
+
+// Size of a frame of the DM163 peripheral with index i: the brightness bank
+// and the banks of each row
+#define DM163_FRAME_SIZE(i)                                                  \
+  (DM163_NUM_CHANNELS(i) * (DM163_NUM_ROWS(i) * ROW_BANKS + 1))
+
+// Row GPIOs and scan thread stack of the DM163 peripheral with index i
+#define DM163_SCAN_DEFINE(i)                                                 \
+  static const struct gpio_dt_spec dm163_rows_##i[] = {                      \
+      DT_FOREACH_PROP_ELEM_SEP(DM163_MATRIX(i), rows_gpios,                  \
+                               GPIO_DT_SPEC_GET_BY_IDX, (, ))};              \
+  static K_KERNEL_STACK_DEFINE(dm163_scan_stack_##i,                         \
+                               CONFIG_DM163_SCAN_THREAD_STACK_SIZE);
+
+#define DM163_SCAN_CONFIG(i)                                                 \
+  .rows = dm163_rows_##i, .scan_stack = dm163_scan_stack_##i,                \
+  .scan_stack_size = K_KERNEL_STACK_SIZEOF(dm163_scan_stack_##i),
+
 // Macro to initialize the DM163 peripheral with index i
 #define DM163_DEVICE(i)                                                        \
                                                                                \
+  BUILD_ASSERT(!DM163_HAS_MATRIX(i) || IS_ENABLED(CONFIG_DM163_SCAN),          \
+               "CONFIG_DM163_SCAN is needed to drive an rgb_matrix");          \
+  BUILD_ASSERT(DM163_NUM_ROWS(i) <= UINT8_MAX, "too many rgb_matrix rows");    \
+  BUILD_ASSERT(DT_INST_PROP(i, chain_length) >= 1 &&                           \
+                   DT_INST_PROP(i, chain_length) <= UINT8_MAX,                 \
+               "chain-length must be between 1 and 255");                      \
+  IF_ENABLED(DM163_HAS_MATRIX(i), (DM163_SCAN_DEFINE(i)))                      \
+                                                                               \
+  BUILD_ASSERT(DT_INST_NODE_HAS_PROP(i, spi) ||                                \
+                   (DT_INST_NODE_HAS_PROP(i, sin_gpios) &&                     \
+                    DT_INST_NODE_HAS_PROP(i, gck_gpios)),                      \
+               "DM163 needs either spi or both sin-gpios and gck-gpios");      \
+  BUILD_ASSERT(!(DT_INST_NODE_HAS_PROP(i, en_gpios) &&                         \
+                 DT_INST_NODE_HAS_PROP(i, pwms)),                              \
+               "DM163 EN is driven by either en-gpios or pwms, not both");     \
+                                                                               \
+  /* Frames and bitstreams sized for the chain and the rows of the matrix   */ \
+  static uint8_t dm163_frame_banks_##i[3 * DM163_FRAME_SIZE(i)];               \
+  static uint8_t dm163_brightness_stream_##i[BRIGHTNESS_STREAM_SIZE(           \
+      DT_INST_PROP(i, chain_length))];                                         \
+  static uint8_t dm163_channels_stream_##i[DM163_NUM_ROWS(i) *                 \
+                                           CHANNELS_STREAM_SIZE(DT_INST_PROP(  \
+                                               i, chain_length))];             \
+  IF_ENABLED(CONFIG_DM163_SCAN_DITHER,                                         \
+             (static uint8_t dm163_dither_row_##i[DM163_NUM_CHANNELS(i)];))    \
+                                                                               \
   /* Build a dm163_config for DM163 peripheral with index i, named          */ \
   /* dm163_config_/i/ (for example dm163_config_0 for the first peripheral) */ \
   static const struct dm163_config dm163_config_##i = {                        \
       .en = GPIO_DT_SPEC_GET_OR(DT_DRV_INST(i), en_gpios, {0}),                \
-      .gck = GPIO_DT_SPEC_GET(DT_DRV_INST(i), gck_gpios),                      \
+      .gck = GPIO_DT_SPEC_GET_OR(DT_DRV_INST(i), gck_gpios, {0}),              \
       .lat = GPIO_DT_SPEC_GET(DT_DRV_INST(i), lat_gpios),                      \
       .rst = GPIO_DT_SPEC_GET(DT_DRV_INST(i), rst_gpios),                      \
       .selbk = GPIO_DT_SPEC_GET(DT_DRV_INST(i), selbk_gpios),                  \
-      .sin = GPIO_DT_SPEC_GET(DT_DRV_INST(i), sin_gpios),                      \
+      .sin = GPIO_DT_SPEC_GET_OR(DT_DRV_INST(i), sin_gpios, {0}),              \
+      IF_ENABLED(CONFIG_DM163_DIRECT_PORT_WRITES, (DM163_DIRECT_CONFIG(i)))    \
+      IF_ENABLED(CONFIG_DM163_DRIVER_PWM,                                      \
+                 (.en_pwm = PWM_DT_SPEC_INST_GET_OR(i, {0}), ))                \
+      IF_ENABLED(CONFIG_DM163_DRIVER_SPI, (DM163_SPI_CONFIG(i)))               \
+      IF_ENABLED(DM163_HAS_MATRIX(i), (DM163_SCAN_CONFIG(i)))                  \
+      .num_rows = DM163_NUM_ROWS(i),                                           \
+      .chain_length = DT_INST_PROP(i, chain_length),                           \
+      .num_channels = DM163_NUM_CHANNELS(i),                                   \
+      .frame_banks = dm163_frame_banks_##i,                                    \
+      .frame_size = DM163_FRAME_SIZE(i),                                       \
+      .brightness_stream = dm163_brightness_stream_##i,                        \
+      .channels_stream = dm163_channels_stream_##i,                            \
+      IF_ENABLED(CONFIG_DM163_SCAN_DITHER,                                     \
+                 (.dither_row = dm163_dither_row_##i, ))                       \
   };                                                                           \
                                                                                \
   /* Build a new dm163_data_/i/ structure for dynamic data                  */ \
@@ -123,123 +672,1203 @@ static const struct led_driver_api dm163_api = {
 // in the device tree and pass it the corresponding index.
 DT_INST_FOREACH_STATUS_OKAY(DM163_DEVICE)
 
-void dm163_turn_off_row(const struct device *dev,
-                        const struct gpio_dt_spec *row) {
-  row_to_turn_off = row;
+int dm163_begin_update(const struct device *dev) {
+  struct dm163_data *data = dev->data;
+  k_spinlock_key_t key = lock_producers(data);
+  int ret = 0;
+
+  if (data->update_depth == UINT8_MAX) {
+    ret = -EBUSY;
+  } else {
+    data->update_depth++;
+  }
+  unlock_producers(data, key);
+  return ret;
 }
 
-static int dm163_set_brightness(const struct device *dev, uint32_t led,
-                                uint8_t value) {
+int dm163_commit(const struct device *dev) {
+  const struct dm163_config *config = dev->config;
   struct dm163_data *data = dev->data;
+  k_spinlock_key_t key = lock_producers(data);
+  bool done;
+  uint32_t seq;
 
-  if (led >= NUM_LEDS) return -EINVAL;
+  if (data->update_depth == 0) {
+    unlock_producers(data, key);
+    return -EINVAL;
+  }
+  data->update_depth--;
+  done = data->update_depth == 0;
+  publish_if_done(dev);
+  seq = data->published_seq;
+  unlock_producers(data, key);
+
+  if (done && !config->rows) return wait_flushed(dev, seq);
+  return 0;
+}
+
+int dm163_write_channels_async(const struct device *dev,
+                               uint32_t start_channel, uint32_t num_channels,
+                               const uint8_t *buf, dm163_callback_t callback,
+                               void *user_data) {
+  const struct dm163_config *config = dev->config;
+  struct dm163_data *data = dev->data;
+  uint32_t total_channels = num_leds(dev) * 3;
+  uint32_t seq;
+  int ret;
 
-  // converting the values from [0, 100] to [0, 63]
-  value = value * 63 / 100;
+  if (num_channels > total_channels ||
+      start_channel > total_channels - num_channels) {
+    return -EINVAL;
+  }
 
-  data->brightness[led * 3] = value;
-  data->brightness[led * 3 + 1] = value;
-  data->brightness[led * 3 + 2] = value;
+  ret = change_bank(dev, channels_offset(dev, 0) + start_channel,
+                    num_channels, buf, NULL, DIRTY_CHANNELS, callback,
+                    user_data, &seq);
+  if (ret < 0) return ret;
 
-  flush_brightness(dev);
+  // When scanning an rgb_matrix, the scan picks the new frame up on its
+  // own.
+  if (!config->rows) k_work_submit_to_queue(&dm163_workq, &data->flush_work);
   return 0;
 }
 
-static int dm163_on(const struct device *dev, uint32_t led) {
+int dm163_write_channels_wide(const struct device *dev,
+                              uint32_t start_channel, uint32_t num_channels,
+                              const uint16_t *buf) {
+  uint32_t total_channels = num_leds(dev) * 3;
+  uint8_t values[CHIP_CHANNELS], fractions[CHIP_CHANNELS];
+  uint32_t seq;
+  int ret;
+
+  if (num_channels > total_channels ||
+      start_channel > total_channels - num_channels) {
+    return -EINVAL;
+  }
+
+  // The chunks are published as a single frame.
+  ret = dm163_begin_update(dev);
+  if (ret) return ret;
+
+  for (uint32_t done = 0; done < num_channels && ret >= 0;) {
+    uint32_t count = MIN(num_channels - done, CHIP_CHANNELS);
+
+    for (uint32_t i = 0; i < count; i++) {
+      uint16_t value = MIN(buf[done + i], BIT(CHANNEL_BITS + DITHER_BITS) - 1);
+
+      values[i] = value >> DITHER_BITS;
+      fractions[i] = value & (BIT(DITHER_BITS) - 1);
+    }
+    ret = change_bank(dev, channels_offset(dev, 0) + start_channel + done,
+                      count, values, fractions, DIRTY_CHANNELS, NULL, NULL,
+                      &seq);
+    done += count;
+  }
+
+  dm163_commit(dev);
+  return ret < 0 ? ret : 0;
+}
+
+/*
+ * The duty cycle of EN gates the outputs of the DM163 in hardware, so the
+ * banks are left untouched.
+ */
+int dm163_set_global_brightness(const struct device *dev, uint8_t value) {
+#ifdef CONFIG_DM163_DRIVER_PWM
+  const struct dm163_config *config = dev->config;
+
+  if (value > 100) return -EINVAL;
+  if (!config->en_pwm.dev) return -ENOTSUP;
+
+  return pwm_set_pulse_dt(&config->en_pwm,
+                          (uint64_t)config->en_pwm.period * value / 100);
+#else
+  return -ENOTSUP;
+#endif
+}
+
+#ifdef CONFIG_DM163_ANIMATION
+int dm163_play_animation(const struct device *dev,
+                         const struct dm163_animation *animation) {
+  const struct dm163_config *config = dev->config;
   struct dm163_data *data = dev->data;
 
-  if (led >= NUM_LEDS) return -EINVAL;
+  if (!config->rows) return -ENOTSUP;
+  if (animation->num_frames == 0 ||
+      animation->num_rows != config->num_rows ||
+      animation->stream_size != CHANNELS_STREAM_SIZE(config->chain_length)) {
+    return -EINVAL;
+  }
+
+  atomic_ptr_set(&data->animation, (atomic_ptr_val_t)animation);
+  return 0;
+}
 
-  data->channels[led * 3] = 0xff;
-  data->channels[led * 3 + 1] = 0xff;
-  data->channels[led * 3 + 2] = 0xff;
+int dm163_stop_animation(const struct device *dev) {
+  struct dm163_data *data = dev->data;
 
-  flush_channels(dev);
+  atomic_ptr_set(&data->animation, NULL);
   return 0;
 }
 
-static int dm163_off(const struct device *dev, uint32_t led) {
+bool dm163_animation_playing(const struct device *dev) {
   struct dm163_data *data = dev->data;
 
-  if (led >= NUM_LEDS) return -EINVAL;
+  return atomic_ptr_get(&data->animation) != NULL;
+}
+#endif
 
-  data->channels[led * 3] = 0x00;
-  data->channels[led * 3 + 1] = 0x00;
-  data->channels[led * 3 + 2] = 0x00;
+int dm163_get_frame_stats(const struct device *dev,
+                          struct dm163_frame_stats *stats) {
+  struct dm163_data *data = dev->data;
 
-  flush_channels(dev);
+  stats->dropped = atomic_get(&data->frames_dropped);
+  stats->torn = atomic_get(&data->frames_torn);
   return 0;
 }
 
-static void pulse_data(const struct dm163_config *config, uint8_t data,
-                       int bits) {
-  for (int led = bits - 1; led >= 0; led--) {
-    uint8_t bit = (data >> (led)) & 0x1;
-    gpio_pin_set_dt(&(config->sin), bit);
-    gpio_pin_set_dt(&(config->gck), 1);
-    gpio_pin_set_dt(&(config->gck), 0);
+#ifdef CONFIG_DM163_BENCHMARK
+typedef int (*bench_op_t)(const struct device *dev, uint32_t i);
+
+// Turn the first LED on and off, so that every write changes the frame
+static int bench_write_channels(const struct device *dev, uint32_t i) {
+  uint8_t values[3];
+
+  memset(values, i % 2 ? 0x00 : 0xff, sizeof(values));
+  return led_write_channels(dev, 0, sizeof(values), values);
+}
+
+// Change the color of every LED in turn, one frame each
+static int bench_set_color(const struct device *dev, uint32_t i) {
+  uint8_t color[3] = {i & 0xff, ~i & 0xff, 0x80};
+
+  return led_set_color(dev, i % num_leds(dev), 3, color);
+}
+
+static int bench_brightness(const struct device *dev, uint32_t i) {
+  return led_set_brightness(dev, 0, i % 2 ? 6 : 5);
+}
+
+// Change every LED in a single update
+static int bench_refresh(const struct device *dev, uint32_t i) {
+  uint8_t color[3] = {i & 0xff, ~i & 0xff, 0x80};
+  int ret = dm163_begin_update(dev);
+
+  if (ret) return ret;
+  for (uint32_t led = 0; led < num_leds(dev) && !ret; led++) {
+    ret = dm163_set_color(dev, led, 3, color);
   }
+  dm163_commit(dev);
+  return ret;
+}
+
+static const struct {
+  const char *name;
+  bench_op_t op;
+} dm163_benches[DM163_BENCH_COUNT] = {
+    {"write_channels", bench_write_channels},
+    {"set_color", bench_set_color},
+    {"brightness", bench_brightness},
+    {"refresh", bench_refresh},
+};
+
+#ifdef CONFIG_DM163_SCAN
+/*
+ * Park the scan thread between two rows, so that the caller can shift the
+ * rows out itself. The thread may be in the middle of a row, in which case
+ * it parks once done with it.
+ */
+static void bench_pause_scan(const struct device *dev) {
+  struct dm163_data *data = dev->data;
+
+  k_timer_stop(&data->scan_timer);
+  atomic_set(&data->scan_pause, 1);
+  // Wakes the thread up if it waits for the timer, which no longer runs.
+  k_sem_give(&data->scan_sem);
+  k_sem_take(&data->scan_parked, K_FOREVER);
+}
+
+static void bench_resume_scan(const struct device *dev) {
+  struct dm163_data *data = dev->data;
+
+  atomic_clear(&data->scan_pause);
+  k_sem_give(&data->scan_resume);
+  k_timer_start(&data->scan_timer, row_period(dev), row_period(dev));
 }
 
-static void flush_channels(const struct device *dev) {
+/*
+ * Shift out all the rows of the matrix, starting from the first one so
+ * that the frame just written is picked up. The scan must have stopped on
+ * the last row.
+ */
+static void bench_scan_frame(const struct device *dev) {
   const struct dm163_config *config = dev->config;
+
+  for (int row = 0; row < config->num_rows; row++) scan_next_row(dev);
+}
+#endif
+
+/*
+ * The scan thread is parked for the whole run, and the benchmark shifts
+ * out a whole frame after each operation itself, so that every operation
+ * is timed up to the latch like without rows, where the writes flush
+ * before returning.
+ * max_lock_cycles is shared with dm163_get_stats(), whose value is reset
+ * by each benchmark.
+ */
+int dm163_benchmark(const struct device *dev, uint32_t iterations,
+                    struct dm163_bench_result results[DM163_BENCH_COUNT]) {
   struct dm163_data *data = dev->data;
+  int ret = 0;
 
-  k_mutex_lock(&data->flush_mutex, K_FOREVER);
-  for (int i = NUM_CHANNELS - 1; i >= 0; i--) {
-    pulse_data(config, data->channels[i], 8);
-    if (i == 2 && row_to_turn_off != NULL) {
-      gpio_pin_set_dt(row_to_turn_off, 0);
-      row_to_turn_off = NULL;
+  if (iterations == 0) return -EINVAL;
+
+#ifdef CONFIG_DM163_SCAN
+  const struct dm163_config *config = dev->config;
+
+  if (config->rows) {
+    bench_pause_scan(dev);
+    // Finish the scan in progress, the next row is the first one
+    while (data->scan_row != config->num_rows - 1) scan_next_row(dev);
+  }
+#endif
+
+  for (int b = 0; b < DM163_BENCH_COUNT && !ret; b++) {
+    struct dm163_bench_result *result = &results[b];
+
+    memset(result, 0, sizeof(*result));
+    result->name = dm163_benches[b].name;
+    atomic_set(&data->gpio_calls, 0);
+    atomic_clear(&data->max_lock_cycles);
+
+    for (uint32_t i = 0; i < iterations && !ret; i++) {
+      uint32_t start = k_cycle_get_32();
+
+      ret = dm163_benches[b].op(dev, i);
+#ifdef CONFIG_DM163_SCAN
+      if (config->rows) bench_scan_frame(dev);
+#endif
+      result->cycles += k_cycle_get_32() - start;
+      result->ops++;
+    }
+    result->gpio_calls = atomic_get(&data->gpio_calls);
+    result->max_lock_cycles = atomic_get(&data->max_lock_cycles);
+  }
+
+#ifdef CONFIG_DM163_SCAN
+  if (config->rows) bench_resume_scan(dev);
+#endif
+  return ret;
+}
+#endif
+
+#ifdef CONFIG_DM163_STATS
+int dm163_get_stats(const struct device *dev, struct dm163_stats *stats) {
+  struct dm163_data *data = dev->data;
+
+  stats->flushes = atomic_get(&data->flushes);
+  stats->bytes = counter64_get(&data->bytes);
+  stats->min_flush_cycles =
+      stats->flushes ? atomic_get(&data->min_flush_cycles) : 0;
+  stats->max_flush_cycles = atomic_get(&data->max_flush_cycles);
+  stats->total_flush_cycles = counter64_get(&data->total_flush_cycles);
+  stats->max_lock_cycles = atomic_get(&data->max_lock_cycles);
+  stats->skipped_writes = atomic_get(&data->skipped_writes);
+  stats->frames_dropped = atomic_get(&data->frames_dropped);
+  stats->frames_torn = atomic_get(&data->frames_torn);
+  return 0;
+}
+
+int dm163_reset_stats(const struct device *dev) {
+  struct dm163_data *data = dev->data;
+
+  atomic_clear(&data->flushes);
+  counter64_clear(&data->bytes);
+  atomic_set(&data->min_flush_cycles, (atomic_val_t)UINT32_MAX);
+  atomic_clear(&data->max_flush_cycles);
+  counter64_clear(&data->total_flush_cycles);
+  atomic_clear(&data->max_lock_cycles);
+  atomic_clear(&data->skipped_writes);
+  atomic_clear(&data->frames_dropped);
+  atomic_clear(&data->frames_torn);
+  return 0;
+}
+#endif
+
+/*
+ * The dot correction bank is shared by all the rows, so the brightness of
+ * a LED applies to its whole column. It holds percents, converted to the
+ * 6 bits of the DM163 when the bank is encoded.
+ */
+static int dm163_set_brightness(const struct device *dev, uint32_t led,
+                                uint8_t value) {
+  const struct dm163_config *config = dev->config;
+  uint8_t values[3];
+  uint32_t seq;
+  int ret;
+
+  if (led >= num_leds(dev) || value > 100) return -EINVAL;
+
+  memset(values, value, sizeof(values));
+
+  ret = change_bank(dev, led % num_columns(dev) * 3, 3, values, NULL,
+                    DIRTY_BRIGHTNESS, NULL, NULL, &seq);
+  if (ret == 0 && !config->rows) return wait_flushed(dev, seq);
+  return ret < 0 ? ret : 0;
+}
+
+static int dm163_on(const struct device *dev, uint32_t led) {
+  static const uint8_t on[3] = {0xff, 0xff, 0xff};
+
+  if (led >= num_leds(dev)) return -EINVAL;
+
+  return dm163_write_channels(dev, led * 3, 3, on);
+}
+
+static int dm163_off(const struct device *dev, uint32_t led) {
+  static const uint8_t off[3] = {0x00, 0x00, 0x00};
+
+  if (led >= num_leds(dev)) return -EINVAL;
+
+  return dm163_write_channels(dev, led * 3, 3, off);
+}
+
+// Extend a range of a frame, empty when start == end, to [start, end)
+static inline void extend_range(size_t *range_start, size_t *range_end,
+                                size_t start, size_t end) {
+  if (*range_start == *range_end) {
+    *range_start = start;
+    *range_end = end;
+    return;
+  }
+  *range_start = MIN(*range_start, start);
+  *range_end = MAX(*range_end, end);
+}
+
+static void mark_dirty(struct dm163_data *data, uint32_t start, uint32_t count,
+                       uint8_t dirty_flag) {
+  data->dirty |= dirty_flag;
+  extend_range(&data->dirty_start, &data->dirty_end, start, start + count);
+}
+
+/*
+ * Copy values into a bank, or clear it if values is NULL, and mark it dirty
+ * only if this changes it, so that writes which do not change anything
+ * never reach the bus.
+ */
+static bool update_bank(struct dm163_data *data, uint8_t *bank,
+                        uint32_t start, uint32_t count, const uint8_t *values,
+                        uint8_t dirty_flag) {
+  if (!values) {
+    for (uint32_t i = 0; i < count; i++) {
+      if (bank[start + i]) {
+        memset(&bank[start], 0, count);
+        mark_dirty(data, start, count, dirty_flag);
+        return true;
+      }
     }
+    return false;
+  }
+  if (memcmp(&bank[start], values, count) != 0) {
+    memcpy(&bank[start], values, count);
+    mark_dirty(data, start, count, dirty_flag);
+    return true;
   }
+  return false;
+}
+
+/*
+ * Publish the back frame as the latest complete frame if it changed and no
+ * update started by dm163_begin_update() is still in progress.
+ * The frame handed back only differs from the published one in its stale
+ * range, so only that range is copied, not the whole frame.
+ * Must be called with producer_lock held.
+ */
+static void publish_if_done(const struct device *dev) {
+  struct dm163_data *data = dev->data;
+  atomic_val_t old_state, new_state;
+  uint8_t published = data->back_frame;
+  struct dm163_frame *back;
+
+  if (data->update_depth > 0 || !data->dirty) return;
+
+  data->frames[published].seq = ++data->published_seq;
+  // The other frames now lag behind in the range this one changed.
+  for (int i = 0; i < ARRAY_SIZE(data->frames); i++) {
+    if (i == published) continue;
+    extend_range(&data->frames[i].stale_start, &data->frames[i].stale_end,
+                 data->dirty_start, data->dirty_end);
+  }
+  do {
+    old_state = atomic_get(&data->frame_state);
+    new_state = published | FRAME_FRESH | (data->dirty << FRAME_DIRTY_SHIFT);
+    // A frame the flush context did not pick up is replaced by this one,
+    // which must then also carry the banks it changed.
+    if (old_state & FRAME_FRESH) {
+      new_state |= old_state & ~(FRAME_INDEX_MASK | FRAME_FRESH);
+    }
+  } while (!atomic_cas(&data->frame_state, old_state, new_state));
+
+  if (old_state & FRAME_FRESH) {
+    atomic_inc(&data->frames_dropped);
+  }
+
+  // Continue from the published frame in the frame handed back
+  data->back_frame = old_state & FRAME_INDEX_MASK;
+  back = &data->frames[data->back_frame];
+  memcpy(&back->banks[back->stale_start],
+         &data->frames[published].banks[back->stale_start],
+         back->stale_end - back->stale_start);
+  back->stale_start = back->stale_end = 0;
+  data->dirty = 0;
+  data->dirty_start = data->dirty_end = 0;
+}
+
+// Whether the frame with sequence number seq has been latched
+static inline bool seq_latched(struct dm163_data *data, uint32_t seq) {
+  return (int32_t)((uint32_t)atomic_get(&data->latched_seq) - seq) >= 0;
+}
+
+// Claim a free slot among the first count ones, NULL if there is none
+static struct dm163_completion *claim_completion(struct dm163_data *data,
+                                                 int count) {
+  for (int i = 0; i < count; i++) {
+    if (atomic_cas(&data->completions[i].state, COMPLETION_FREE,
+                   COMPLETION_CLAIMED)) {
+      return &data->completions[i];
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Take an armed slot whose frame has been latched, to call its callback.
+ * Return false if it is not armed, or if its frame is not latched yet.
+ */
+static bool take_completion(struct dm163_data *data,
+                            struct dm163_completion *completion,
+                            struct dm163_completion *taken) {
+  if (!atomic_cas(&completion->state, COMPLETION_ARMED, COMPLETION_FIRING)) {
+    return false;
+  }
+  // The slot may have been armed again since the caller looked at it.
+  if (!seq_latched(data, completion->seq)) {
+    atomic_set(&completion->state, COMPLETION_ARMED);
+    return false;
+  }
+  taken->callback = completion->callback;
+  taken->user_data = completion->user_data;
+  atomic_dec(&data->pending_completions);
+  atomic_set(&completion->state, COMPLETION_FREE);
+  return true;
+}
+
+/*
+ * Make callback wait in a claimed slot for the frame with sequence number
+ * seq to be latched. Return false if it already is, in which case the
+ * caller calls callback itself once producer_lock is released.
+ */
+static bool arm_completion(struct dm163_data *data,
+                           struct dm163_completion *completion, uint32_t seq,
+                           dm163_callback_t callback, void *user_data) {
+  struct dm163_completion taken;
+
+  completion->callback = callback;
+  completion->user_data = user_data;
+  completion->seq = seq;
+  atomic_inc(&data->pending_completions);
+  atomic_set(&completion->state, COMPLETION_ARMED);
+
+  // The flush context sets latched_seq before it looks at the slots, so
+  // either it sees this one armed or the frame is seen latched here.
+  return !(seq_latched(data, seq) && take_completion(data, completion, &taken));
+}
+
+/*
+ * Apply a change to the back frame and publish it unless an update is in
+ * progress. When dithering, the fractions of changed channels are set from
+ * fractions, or cleared if it is NULL. seq is set to the sequence number of
+ * the frame holding the change, and callback, if any, is called once that
+ * frame is latched.
+ * Return 1 if the change waits for the end of an update, 0 if it has been
+ * published, -EBUSY if too many callbacks are already waiting.
+ */
+static int change_bank(const struct device *dev, size_t offset,
+                       uint32_t count, const uint8_t *values,
+                       const uint8_t *fractions, uint8_t dirty_flag,
+                       dm163_callback_t callback, void *user_data,
+                       uint32_t *seq) {
+  struct dm163_data *data = dev->data;
+  struct dm163_completion *completion = NULL;
+  k_spinlock_key_t key = lock_producers(data);
+  bool changed, deferred, armed = true;
+
+  if (callback) {
+    completion = claim_completion(data, CONFIG_DM163_ASYNC_QUEUE_SIZE);
+    if (!completion) {
+      unlock_producers(data, key);
+      return -EBUSY;
+    }
+  }
+
+  changed = update_bank(data, data->frames[data->back_frame].banks, offset,
+                        count, values, dirty_flag);
+  if (DITHER_BITS > 0 && dirty_flag == DIRTY_CHANNELS) {
+    changed |= update_bank(
+        data, data->frames[data->back_frame].banks,
+        offset - channels_offset(dev, 0) + fractions_offset(dev, 0), count,
+        fractions, dirty_flag);
+  }
+#ifdef CONFIG_DM163_STATS
+  if (!changed) atomic_inc(&data->skipped_writes);
+#endif
+  publish_if_done(dev);
+  deferred = data->update_depth > 0;
+  // A change that did not need a new frame is in the latest published one.
+  *seq = data->published_seq + deferred;
+  if (completion) {
+    armed = arm_completion(data, completion, *seq, callback, user_data);
+  }
+  unlock_producers(data, key);
+
+  if (!armed) callback(dev, atomic_get(&data->latched_status), user_data);
+  return deferred;
+}
+
+/*
+ * Call the callbacks waiting for frames up to seq, which has just been
+ * latched, with the error of the transfers which shifted it out, if any.
+ * Only called from the flush context, which never takes producer_lock.
+ */
+static void complete_latched(const struct device *dev, uint32_t seq,
+                             int status) {
+  struct dm163_data *data = dev->data;
+
+  atomic_set(&data->latched_status, status);
+  atomic_set(&data->latched_seq, seq);
+  if (atomic_get(&data->pending_completions) == 0) return;
+
+  for (int i = 0; i < ARRAY_SIZE(data->completions); i++) {
+    struct dm163_completion taken;
+
+    if (take_completion(data, &data->completions[i], &taken)) {
+      taken.callback(dev, status, taken.user_data);
+    }
+  }
+}
+
+// Synchronous call waiting for its frame in a completion slot
+struct dm163_sync_wait {
+  struct k_sem latched;
+  int status;
+};
+
+static void sync_done(const struct device *dev, int status, void *user_data) {
+  struct dm163_sync_wait *wait = user_data;
+
+  wait->status = status;
+  k_sem_give(&wait->latched);
+}
+
+/*
+ * Flush the frames from the calling thread and wait until the frame with
+ * sequence number seq has been latched, as another producer may have been
+ * flushing at the same time. When the asynchronous writes hold all their
+ * slots, the caller waits for the slot kept for synchronous calls, which
+ * is only held until a frame is latched.
+ * Return the error of the transfers which shifted the frame out, if any.
+ */
+static int wait_flushed(const struct device *dev, uint32_t seq) {
+  struct dm163_data *data = dev->data;
+  struct dm163_completion *completion;
+  struct dm163_sync_wait wait;
+  bool reserved = false;
+
+  flush_frames(dev);
+  if (seq_latched(data, seq)) return atomic_get(&data->latched_status);
+
+  completion = claim_completion(data, CONFIG_DM163_ASYNC_QUEUE_SIZE);
+  if (!completion) {
+    k_sem_take(&data->sync_slot, K_FOREVER);
+    completion = &data->completions[SYNC_COMPLETION];
+    atomic_set(&completion->state, COMPLETION_CLAIMED);
+    reserved = true;
+  }
+
+  k_sem_init(&wait.latched, 0, 1);
+  if (arm_completion(data, completion, seq, sync_done, &wait)) {
+    k_sem_take(&wait.latched, K_FOREVER);
+  } else {
+    wait.status = atomic_get(&data->latched_status);
+  }
+  if (reserved) k_sem_give(&data->sync_slot);
+  return wait.status;
+}
+
+static void flush_work_handler(struct k_work *work) {
+  struct dm163_data *data = CONTAINER_OF(work, struct dm163_data, flush_work);
+
+  flush_frames(data->dev);
+}
+
+/*
+ * Make the latest complete frame the front frame if the flush context has
+ * not picked it up yet. Return the banks it changes, 0 if there is none.
+ * Only called from the flush context.
+ */
+static uint8_t pick_up_frame(struct dm163_data *data) {
+  atomic_val_t state;
+
+  if (!(atomic_get(&data->frame_state) & FRAME_FRESH)) return 0;
+
+  // Hand the previous front frame back to the producers
+  state = atomic_set(&data->frame_state, data->front_frame);
+  data->front_frame = state & FRAME_INDEX_MASK;
+  return state >> FRAME_DIRTY_SHIFT;
+}
+
+/*
+ * When there is no scan, the producers flush the frames themselves. Only
+ * one of them does it at a time and it keeps going while new frames are
+ * published, so the others never wait for it.
+ */
+static void flush_frames(const struct device *dev) {
+  struct dm163_data *data = dev->data;
+  uint8_t dirty;
+
+  while ((atomic_get(&data->frame_state) & FRAME_FRESH) &&
+         atomic_cas(&data->flushing, 0, 1)) {
+    while ((dirty = pick_up_frame(data))) {
+      const struct dm163_frame *frame = &data->frames[data->front_frame];
+      int status = 0;
+
+      TRACE_FLUSH_START(dev, frame->seq);
+      if (dirty & DIRTY_BRIGHTNESS) status = flush_brightness(dev, frame);
+      if (dirty & DIRTY_CHANNELS) {
+        int ret = flush_channels(dev, frame);
+
+        if (!status) status = ret;
+      }
+      TRACE_LATCH(dev, frame->seq);
+      complete_latched(dev, frame->seq, status);
+    }
+    atomic_clear(&data->flushing);
+  }
+}
+
+/*
+ * Pack a bank into a bitstream in the order the DM163 chain expects it on
+ * SIN: last channel first, each value on `bits` bits, most significant bit
+ * first. The first DM163 of the chain passes what it shifts out on to the
+ * next one, so the channels of the last DM163 are the first shifted in.
+ * Each value goes through a lookup table, the one of its color starting
+ * lut_stride * color entries into lut.
+ */
+static void encode_bank(uint8_t *stream, const uint8_t *values, int count,
+                        int bits, const uint8_t *lut, size_t lut_stride) {
+  int bit = 0;
+
+  memset(stream, 0, count * bits / 8);
+  for (int i = count - 1; i >= 0; i--) {
+    uint8_t value = lut[i % 3 * lut_stride + values[i]];
+
+    for (int b = bits - 1; b >= 0; b--, bit++) {
+      if ((value >> b) & 0x1) {
+        stream[bit / 8] |= 0x80 >> (bit % 8);
+      }
+    }
+  }
+}
+
+// Add a pin to the raw pins to set or clear for a logical level
+static void add_pin(const struct gpio_dt_spec *spec, int value,
+                    gpio_port_pins_t *set, gpio_port_pins_t *clear) {
+  if (spec->dt_flags & GPIO_ACTIVE_LOW) {
+    value = !value;
+  }
+  if (value) {
+    *set |= BIT(spec->pin);
+  } else {
+    *clear |= BIT(spec->pin);
+  }
+}
+
+static void init_port_words(const struct device *dev) {
+  const struct dm163_config *config = dev->config;
+  struct dm163_data *data = dev->data;
+  struct dm163_port_words *words = &data->port_words;
+
+  memset(words, 0, sizeof(*words));
+  words->shared_port = config->sin.port == config->gck.port;
+  add_pin(&config->gck, 1, &words->rise_set, &words->rise_clear);
+  add_pin(&config->gck, 0, &words->fall_set, &words->fall_clear);
+  for (int bit = 0; bit < 2; bit++) {
+    add_pin(&config->sin, bit, &words->sin_set[bit], &words->sin_clear[bit]);
+    if (words->shared_port) {
+      add_pin(&config->gck, 0, &words->sin_set[bit], &words->sin_clear[bit]);
+    }
+  }
+#ifdef CONFIG_DM163_DIRECT_PORT_WRITES
+  if (config->sin_regs && config->gck_regs) {
+    words->sin_bsrr = &config->sin_regs->BSRR;
+    words->gck_bsrr = &config->gck_regs->BSRR;
+    for (int bit = 0; bit < 2; bit++) {
+      words->sin_word[bit] = words->sin_set[bit] | words->sin_clear[bit] << 16;
+    }
+    words->rise_word = words->rise_set | words->rise_clear << 16;
+    words->fall_word = words->fall_set | words->fall_clear << 16;
+  }
+#endif
+  LOG_DBG("sin and gck %s the same port",
+          words->shared_port ? "share" : "do not share");
+}
+
+#ifdef CONFIG_DM163_DIRECT_PORT_WRITES
+/*
+ * pulse_data() storing the precomputed words straight into the BSRR
+ * registers of the STM32 ports, each edge being a single store instead of
+ * a call through the GPIO API
+ */
+static int pulse_data_direct(const struct dm163_port_words *words,
+                             const uint8_t *stream, int bits) {
+  volatile uint32_t *sin_bsrr = words->sin_bsrr;
+  volatile uint32_t *gck_bsrr = words->gck_bsrr;
+  int writes = 2 * bits;
+
+  if (words->shared_port) {
+    for (int i = 0; i < bits / 8; i++) {
+      for (int b = 7; b >= 0; b--) {
+        *sin_bsrr = words->sin_word[(stream[i] >> b) & 0x1];
+        *gck_bsrr = words->rise_word;
+      }
+    }
+    *gck_bsrr = words->fall_word;
+    return writes + 1;
+  }
+
+  int previous_bit = -1;
+  for (int i = 0; i < bits / 8; i++) {
+    for (int b = 7; b >= 0; b--) {
+      uint8_t bit = (stream[i] >> b) & 0x1;
+
+      if (bit != previous_bit) {
+        *sin_bsrr = words->sin_word[bit];
+        previous_bit = bit;
+        writes++;
+      }
+      *gck_bsrr = words->rise_word;
+      *gck_bsrr = words->fall_word;
+    }
+  }
+  return writes;
+}
+#endif
+
+/*
+ * Replay a bitstream on the GPIOs with raw port writes. When SIN and GCK
+ * share a port, a single write sets SIN and drops GCK, so each bit costs
+ * two port writes. Otherwise SIN is only written when it changes.
+ * Return the number of port writes.
+ */
+static int pulse_data(const struct dm163_config *config,
+                      const struct dm163_port_words *words,
+                      const uint8_t *stream, int bits) {
+  const struct device *sin_port = config->sin.port;
+  const struct device *gck_port = config->gck.port;
+  int writes = 2 * bits;
+
+#ifdef CONFIG_DM163_DIRECT_PORT_WRITES
+  if (words->sin_bsrr) return pulse_data_direct(words, stream, bits);
+#endif
+  if (words->shared_port) {
+    for (int i = 0; i < bits / 8; i++) {
+      for (int b = 7; b >= 0; b--) {
+        uint8_t bit = (stream[i] >> b) & 0x1;
+
+        gpio_port_set_clr_bits_raw(sin_port, words->sin_set[bit],
+                                   words->sin_clear[bit]);
+        gpio_port_set_clr_bits_raw(gck_port, words->rise_set,
+                                   words->rise_clear);
+      }
+    }
+    gpio_port_set_clr_bits_raw(gck_port, words->fall_set, words->fall_clear);
+    return writes + 1;
+  }
+
+  int previous_bit = -1;
+  for (int i = 0; i < bits / 8; i++) {
+    for (int b = 7; b >= 0; b--) {
+      uint8_t bit = (stream[i] >> b) & 0x1;
+
+      if (bit != previous_bit) {
+        gpio_port_set_clr_bits_raw(sin_port, words->sin_set[bit],
+                                   words->sin_clear[bit]);
+        previous_bit = bit;
+        writes++;
+      }
+      gpio_port_set_clr_bits_raw(gck_port, words->rise_set, words->rise_clear);
+      gpio_port_set_clr_bits_raw(gck_port, words->fall_set, words->fall_clear);
+    }
+  }
+  return writes;
+}
+
+/*
+ * Shift a packed bank out on SIN/GCK, as a single SPI transfer if a
+ * controller is available or by toggling the GPIOs otherwise.
+ * Return the error of the SPI transfer, if any.
+ */
+static int shift_out(const struct device *dev, const uint8_t *stream,
+                     int bits) {
+  const struct dm163_config *config = dev->config;
+  struct dm163_data *data = dev->data;
+  int ret = 0;
+#ifdef CONFIG_DM163_STATS
+  uint32_t start = k_cycle_get_32();
+#endif
+
+#ifdef CONFIG_DM163_DRIVER_SPI
+  if (data->use_spi) {
+    const struct spi_buf buf = {.buf = (uint8_t *)stream, .len = bits / 8};
+    const struct spi_buf_set tx = {.buffers = &buf, .count = 1};
+    ret = spi_write(config->spi, &config->spi_config, &tx);
+    if (ret) {
+      LOG_ERR("SPI transfer on %s failed (%d)", dev->name, ret);
+    }
+    COUNT_GPIO_CALLS(data, 1);
+  } else
+#endif
+  {
+    int calls = pulse_data(config, &data->port_words, stream, bits);
+
+    COUNT_GPIO_CALLS(data, calls);
+  }
+
+#ifdef CONFIG_DM163_STATS
+  count_flush(data, bits / 8, k_cycle_get_32() - start);
+#endif
+  return ret;
+}
+
+#ifdef CONFIG_DM163_STATS
+/*
+ * Account for a stream shifted out, each one being followed by a latch.
+ * Only called from the flush context, which is never run by two threads at
+ * once, so the updates need no lock.
+ */
+static void count_flush(struct dm163_data *data, uint32_t bytes,
+                        uint32_t cycles) {
+  if (cycles < (uint32_t)atomic_get(&data->min_flush_cycles)) {
+    atomic_set(&data->min_flush_cycles, cycles);
+  }
+  if (cycles > (uint32_t)atomic_get(&data->max_flush_cycles)) {
+    atomic_set(&data->max_flush_cycles, cycles);
+  }
+  counter64_add(&data->total_flush_cycles, cycles);
+  counter64_add(&data->bytes, bytes);
+  atomic_inc(&data->flushes);
+}
+#endif
+
+#ifdef CONFIG_DM163_SCAN_DITHER
+/*
+ * Thresholds of the phases of the dithering cycle, in bit-reversed order so
+ * that the extra steps of a fraction are spread over the cycle
+ */
+static const uint8_t dither_thresholds[16] = {0, 8, 4, 12, 2, 10, 6, 14,
+                                              1, 9, 5, 13, 3, 11, 7, 15};
+
+/*
+ * Dither the channels of a row: a channel is shown one step higher during
+ * as many refreshes of the dithering cycle as its fraction. LEDs start the
+ * cycle at different phases so that they do not all flicker together.
+ */
+static const uint8_t *dither_row(const struct device *dev,
+                                 const struct dm163_frame *frame,
+                                 uint8_t row) {
+  const struct dm163_config *config = dev->config;
+  struct dm163_data *data = dev->data;
+  const uint8_t *values = &frame->banks[channels_offset(dev, row)];
+  const uint8_t *fractions = &frame->banks[fractions_offset(dev, row)];
+
+  for (int i = 0; i < config->num_channels; i++) {
+    uint8_t phase = (data->dither_phase + row + i / 3) & (BIT(DITHER_BITS) - 1);
+    uint8_t threshold = dither_thresholds[phase] >> (4 - DITHER_BITS);
+
+    config->dither_row[i] = values[i];
+    if (fractions[i] > threshold && values[i] < UINT8_MAX) {
+      config->dither_row[i]++;
+    }
+  }
+  return config->dither_row;
+}
+#endif
+
+/*
+ * Shift out the channels of a row of a frame to the whole chain without
+ * latching them. The stream of the row is only encoded again if `encode`,
+ * otherwise the one encoded for a previous refresh of the same channels is
+ * replayed.
+ */
+static int shift_channels(const struct device *dev,
+                          const struct dm163_frame *frame, uint8_t row,
+                          bool encode) {
+  const struct dm163_config *config = dev->config;
+  const uint8_t *values = &frame->banks[channels_offset(dev, row)];
+  size_t stream_size = CHANNELS_STREAM_SIZE(config->chain_length);
+  uint8_t *stream = &config->channels_stream[row * stream_size];
+
+  if (encode) {
+#ifdef CONFIG_DM163_SCAN_DITHER
+    if (config->rows) values = dither_row(dev, frame, row);
+#endif
+    encode_bank(stream, values, config->num_channels, CHANNEL_BITS,
+                &dm163_channel_lut[0][0], ARRAY_SIZE(dm163_channel_lut[0]));
+  }
+  return shift_out(dev, stream, config->num_channels * CHANNEL_BITS);
+}
+
+static int flush_channels(const struct device *dev,
+                          const struct dm163_frame *frame) {
+  const struct dm163_config *config = dev->config;
+  int ret = shift_channels(dev, frame, 0, true);
+
   gpio_pin_set_dt(&config->lat, 0);
   gpio_pin_set_dt(&config->lat, 1);
-  k_mutex_unlock(&data->flush_mutex);
+  COUNT_GPIO_CALLS((struct dm163_data *)dev->data, 2);
+  return ret;
 }
 
-static void flush_brightness(const struct device *dev) {
+static int flush_brightness(const struct device *dev,
+                            const struct dm163_frame *frame) {
   const struct dm163_config *config = dev->config;
-  struct dm163_data *data = dev->data;
+  int ret;
 
-  k_mutex_lock(&data->flush_mutex, K_FOREVER);
+  encode_bank(config->brightness_stream, frame->banks, config->num_channels,
+              BRIGHTNESS_BITS, dm163_brightness_lut, 0);
   gpio_pin_set_dt(&config->selbk, 0);
-  for (int i = NUM_CHANNELS - 1; i >= 0; i--) {
-    pulse_data(config, data->brightness[i], 6);
-  }
+  ret = shift_out(dev, config->brightness_stream,
+                  config->num_channels * BRIGHTNESS_BITS);
   gpio_pin_set_dt(&config->lat, 0);
   gpio_pin_set_dt(&config->lat, 1);
   gpio_pin_set_dt(&config->selbk, 1);
-  k_mutex_unlock(&data->flush_mutex);
+  COUNT_GPIO_CALLS((struct dm163_data *)dev->data, 4);
+  return ret;
 }
 
 static int dm163_set_color(const struct device *dev, uint32_t led,
                            uint8_t num_colors, const uint8_t *color) {
-  struct dm163_data *data = dev->data;
+  uint8_t values[3];
 
-  if (led >= NUM_LEDS || num_colors > 3) return -EINVAL;
+  if (led >= num_leds(dev) || num_colors > 3) return -EINVAL;
 
   for (uint8_t i = 0; i < 3; i++) {
-    data->channels[led * 3 + i] = (i < num_colors) ? *color++ : 0;
+    values[i] = (i < num_colors) ? *color++ : 0;
   }
 
-  flush_channels(dev);
-  return 0;
+  return dm163_write_channels(dev, led * 3, 3, values);
 }
 
+/*
+ * Synchronous version of dm163_write_channels_async(). Without a scan, it
+ * returns once the channels have been latched, or right away inside an
+ * update. When scanning, the scan shows the new channels within a frame.
+ */
 static int dm163_write_channels(const struct device *dev,
                                 uint32_t start_channel, uint32_t num_channels,
                                 const uint8_t *buf) {
-  struct dm163_data *data = dev->data;
+  const struct dm163_config *config = dev->config;
+  uint32_t total_channels = num_leds(dev) * 3;
+  uint32_t seq;
+  int ret;
 
-  if (start_channel + num_channels > NUM_CHANNELS) {
+  if (num_channels > total_channels ||
+      start_channel > total_channels - num_channels) {
     return -EINVAL;
   }
 
-  for (uint32_t i = start_channel; i < start_channel + num_channels; i++) {
-    data->channels[i] = *buf++;
+  ret = change_bank(dev, channels_offset(dev, 0) + start_channel,
+                    num_channels, buf, NULL, DIRTY_CHANNELS, NULL, NULL, &seq);
+  if (ret == 0 && !config->rows) return wait_flushed(dev, seq);
+  return ret < 0 ? ret : 0;
+}
+
+#ifdef CONFIG_DM163_SCAN
+#ifdef CONFIG_DM163_ANIMATION
+/*
+ * Move the animation on to its next frame once the current one has been
+ * shown long enough, before the first row of each refresh. The animation
+ * is only ever replaced by dm163_play_animation() or dm163_stop_animation(),
+ * the scan picks the change up on its own.
+ */
+static void advance_animation(const struct device *dev) {
+  struct dm163_data *data = dev->data;
+  const struct dm163_animation *animation = atomic_ptr_get(&data->animation);
+  uint32_t refreshes;
+
+  if (animation != data->playing) {
+    data->playing = animation;
+    data->animation_frame = 0;
+    data->frame_refreshes = 0;
+    return;
+  }
+  if (!animation) return;
+
+  refreshes = animation->durations_ms[data->animation_frame] *
+              CONFIG_DM163_SCAN_REFRESH_RATE / MSEC_PER_SEC;
+  if (++data->frame_refreshes < refreshes) return;
+
+  data->frame_refreshes = 0;
+  if (++data->animation_frame < animation->num_frames) return;
+
+  data->animation_frame = 0;
+  if (!animation->loop) {
+    // Show the frames again, unless another animation was started meanwhile
+    atomic_ptr_cas(&data->animation, (atomic_ptr_val_t)animation, NULL);
+    data->playing = NULL;
+  }
+}
+
+// Stream of a row of the frame of the animation being played, NULL if none
+static const uint8_t *animation_stream(const struct device *dev,
+                                       uint8_t row) {
+  struct dm163_data *data = dev->data;
+  const struct dm163_animation *animation = data->playing;
+  size_t index;
+
+  if (!animation) return NULL;
+
+  index = data->animation_frame * animation->num_rows + row;
+  return &animation->streams[index * animation->stream_size];
+}
+#endif
+
+/*
+ * Show the next row of the front frame. Its channels are shifted in while
+ * the current row is still lit with the latched ones. The current row is
+ * only turned off right before the latch and the next one turned on right
+ * after it, so no row ever shows the channels of another one.
+ * A new frame is only picked up before its first row so that all the rows
+ * of a scan come from the same frame.
+ */
+static void scan_next_row(const struct device *dev) {
+  const struct dm163_config *config = dev->config;
+  struct dm163_data *data = dev->data;
+  uint8_t next_row = (data->scan_row + 1) % config->num_rows;
+  uint8_t picked_up = 0;
+  const uint8_t *stream = NULL;
+  int status = 0, ret;
+
+  if (next_row == 0) {
+    if (data->scan_late) {
+      atomic_inc(&data->frames_torn);
+      data->scan_late = false;
+    }
+    data->dither_phase++;
+    picked_up = pick_up_frame(data);
+    if (picked_up) {
+      TRACE_FLUSH_START(dev, data->frames[data->front_frame].seq);
+    }
+    if (picked_up & DIRTY_CHANNELS) data->rows_encoded = 0;
+    if (picked_up & DIRTY_BRIGHTNESS) {
+      status = flush_brightness(dev, &data->frames[data->front_frame]);
+    }
+#ifdef CONFIG_DM163_ANIMATION
+    advance_animation(dev);
+#endif
+  }
+
+#ifdef CONFIG_DM163_ANIMATION
+  stream = animation_stream(dev, next_row);
+#endif
+  // Animations are stored already encoded and go to the bus as they are.
+  if (stream) {
+    ret = shift_out(dev, stream, config->num_channels * CHANNEL_BITS);
+  } else {
+    bool encode = next_row >= data->rows_encoded;
+
+    ret = shift_channels(dev, &data->frames[data->front_frame], next_row,
+                         encode);
+    if (encode && DITHER_BITS == 0) data->rows_encoded = next_row + 1;
+  }
+  if (!status) status = ret;
+  gpio_pin_set_dt(&config->rows[data->scan_row], 0);
+  gpio_pin_set_dt(&config->lat, 0);
+  gpio_pin_set_dt(&config->lat, 1);
+  gpio_pin_set_dt(&config->rows[next_row], 1);
+  COUNT_GPIO_CALLS(data, 4);
+  data->scan_row = next_row;
+
+  if (picked_up) {
+    TRACE_LATCH(dev, data->frames[data->front_frame].seq);
+    complete_latched(dev, data->frames[data->front_frame].seq, status);
+  }
+}
+
+static void scan_timer_expired(struct k_timer *timer) {
+  struct dm163_data *data = CONTAINER_OF(timer, struct dm163_data, scan_timer);
+
+  k_sem_give(&data->scan_sem);
+}
+
+/*
+ * The rows are shifted out from a thread woken up by the scan timer rather
+ * than from the timer handler itself, as the SPI transfers cannot be done
+ * from an ISR.
+ */
+static void scan_thread(void *p1, void *p2, void *p3) {
+  const struct device *dev = p1;
+  struct dm163_data *data = dev->data;
+
+  while (1) {
+    k_sem_take(&data->scan_sem, K_FOREVER);
+#ifdef CONFIG_DM163_BENCHMARK
+    if (atomic_get(&data->scan_pause)) {
+      k_sem_give(&data->scan_parked);
+      k_sem_take(&data->scan_resume, K_FOREVER);
+      continue;
+    }
+#endif
+    // More than one expiry means a row stayed lit longer than the others.
+    if (k_timer_status_get(&data->scan_timer) > 1) {
+      data->scan_late = true;
+    }
+    scan_next_row(dev);
+  }
+}
+
+static k_timeout_t row_period(const struct device *dev) {
+  const struct dm163_config *config = dev->config;
+
+  return K_USEC(USEC_PER_SEC /
+                (CONFIG_DM163_SCAN_REFRESH_RATE * config->num_rows));
+}
+
+static int start_scan(const struct device *dev) {
+  const struct dm163_config *config = dev->config;
+  struct dm163_data *data = dev->data;
+
+  for (int row = 0; row < config->num_rows; row++) {
+    CONFIGURE_PIN(&config->rows[row], GPIO_OUTPUT_INACTIVE);
   }
+  // Start on the last row so that the first scanned row is row 0.
+  data->scan_row = config->num_rows - 1;
+  data->rows_encoded = 0;
+
+  k_sem_init(&data->scan_sem, 0, 1);
+#ifdef CONFIG_DM163_BENCHMARK
+  k_sem_init(&data->scan_parked, 0, 1);
+  k_sem_init(&data->scan_resume, 0, 1);
+#endif
+  k_timer_init(&data->scan_timer, scan_timer_expired, NULL);
+  k_thread_create(&data->scan_thread, config->scan_stack,
+                  config->scan_stack_size, scan_thread, (void *)dev, NULL,
+                  NULL, CONFIG_DM163_SCAN_THREAD_PRIORITY, 0, K_NO_WAIT);
+  k_thread_name_set(&data->scan_thread, dev->name);
+  k_timer_start(&data->scan_timer, row_period(dev), row_period(dev));
 
-  flush_channels(dev);
+  LOG_INF("scanning %d rows at %d Hz", config->num_rows,
+          CONFIG_DM163_SCAN_REFRESH_RATE);
   return 0;
 }
+#endif
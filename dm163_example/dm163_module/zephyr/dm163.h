@@ -2,9 +2,182 @@
 #define DM163_H
 
 #include <zephyr/device.h>
-#include <zephyr/drivers/gpio.h>
 
-void dm163_turn_off_row(const struct device *dev,
-                        const struct gpio_dt_spec *row);
+// Number of LEDs driven by each DM163 of a chain
+#define DM163_CHIP_LEDS 8
 
-#endif
\ No newline at end of file
+/*
+ * A chain of chain-length DM163s drives 8 * chain-length columns, the
+ * first 8 being those of the DM163 wired to the MCU. When the chain drives
+ * an rgb_matrix, the LED API addresses the LEDs of the matrix row after
+ * row: LED (row * columns + column) uses the channels starting at
+ * 3 * (row * columns + column). The rows are refreshed by the driver.
+ */
+
+/*
+ * Start a batch of LED API calls. Changes made until the matching
+ * dm163_commit() are published as a single frame, on the outermost commit.
+ * Updates can be nested. Changes made meanwhile by other threads are
+ * published along with the batch.
+ */
+int dm163_begin_update(const struct device *dev);
+
+/*
+ * End a batch started by dm163_begin_update() and shift out the banks
+ * it changed, if any.
+ * Return -EINVAL if no update is in progress, or the error of the SPI
+ * transfer which shifted the frame out.
+ */
+int dm163_commit(const struct device *dev);
+
+/*
+ * Called once the frame holding a change has been latched by the DM163,
+ * from the thread shifting the frames out. status is 0, or the error of
+ * the SPI transfer which shifted the frame out. It must not call the
+ * blocking LED API of the same DM163.
+ */
+typedef void (*dm163_callback_t)(const struct device *dev, int status,
+                                 void *user_data);
+
+/*
+ * Write channels like led_write_channels() without waiting for them to be
+ * shifted out: the frame is published and shifted out by the driver work
+ * queue, or by the scan when the DM163 drives an rgb_matrix. callback may
+ * be NULL. Inside an update, the callback waits for the outermost commit.
+ * Return -EBUSY if CONFIG_DM163_ASYNC_QUEUE_SIZE callbacks are already
+ * waiting, -EINVAL if the channels are out of range.
+ */
+int dm163_write_channels_async(const struct device *dev,
+                               uint32_t start_channel, uint32_t num_channels,
+                               const uint8_t *buf, dm163_callback_t callback,
+                               void *user_data);
+
+/*
+ * Write channels on 8 + CONFIG_DM163_SCAN_DITHER_BITS bits, the bits below
+ * the 8 bits of the DM163 being shown by temporal dithering when the
+ * DM163 scans an rgb_matrix. Without dithering, this is
+ * led_write_channels() with 16-bit values. The channels are published as
+ * a single frame. Values above the maximum are clamped.
+ */
+int dm163_write_channels_wide(const struct device *dev,
+                              uint32_t start_channel, uint32_t num_channels,
+                              const uint16_t *buf);
+
+/*
+ * Set the intensity of the whole DM163 chain, from 0 to 100, through the
+ * duty cycle of the PWM driving EN. Nothing is shifted out, and the
+ * brightness set through the LED API is kept.
+ * Return -ENOTSUP if EN is not driven by a PWM.
+ */
+int dm163_set_global_brightness(const struct device *dev, uint8_t value);
+
+/*
+ * Animation stored as the channels streams the DM163 chain expects on SIN,
+ * generated at build time by dm163_animation() in CMake from a JSON
+ * description of its frames.
+ */
+struct dm163_animation {
+  // Streams of each row of each frame, frame after frame
+  const uint8_t *streams;
+  // How long each frame is shown
+  const uint16_t *durations_ms;
+  uint16_t num_frames;
+  uint8_t num_rows;
+  // Size of the stream of a row
+  uint16_t stream_size;
+  // Start over after the last frame instead of stopping
+  bool loop;
+};
+
+/*
+ * Replay an animation on the rgb_matrix in place of the frames written
+ * through the LED API, which are shown again when it ends or is stopped.
+ * The animation starts on the next refresh and replaces any animation
+ * being played. The brightness bank is not part of the animation.
+ * Return -ENOTSUP if the DM163 does not scan an rgb_matrix, -EINVAL if the
+ * animation was generated for another matrix or chain.
+ */
+int dm163_play_animation(const struct device *dev,
+                         const struct dm163_animation *animation);
+
+int dm163_stop_animation(const struct device *dev);
+
+// Whether an animation has been started and has not ended yet
+bool dm163_animation_playing(const struct device *dev);
+
+struct dm163_frame_stats {
+  // Frames replaced by a newer one before being shifted out
+  uint32_t dropped;
+  // Scanned frames whose rows were not all lit for the same time because
+  // the scan missed a row period
+  uint32_t torn;
+};
+
+/*
+ * Get the frame counters of the DM163. The LED API never waits for the
+ * flush context: each change is published as a new frame, and the driver
+ * always shifts out the latest one.
+ */
+int dm163_get_frame_stats(const struct device *dev,
+                          struct dm163_frame_stats *stats);
+
+/*
+ * Hooks called by the flush context when it starts shifting out a new
+ * frame, and once the frame is latched, or its first row when scanning.
+ * With CONFIG_DM163_TRACE_HOOKS, they must be defined by the application.
+ */
+void dm163_trace_flush_start(const struct device *dev, uint32_t seq);
+void dm163_trace_latch(const struct device *dev, uint32_t seq);
+
+struct dm163_stats {
+  // Streams shifted out and latched, rows included when scanning
+  uint32_t flushes;
+  uint64_t bytes;
+  // Time taken to shift a stream out, in cycles
+  uint32_t min_flush_cycles;
+  uint32_t max_flush_cycles;
+  uint64_t total_flush_cycles;
+  // Longest time a producer locked the frames, and so the interrupts
+  uint32_t max_lock_cycles;
+  // Writes which did not change any channel or brightness
+  uint32_t skipped_writes;
+  uint32_t frames_dropped;
+  uint32_t frames_torn;
+};
+
+/*
+ * Get the counters of the DM163 since it was initialized or they were
+ * last reset. Only available with CONFIG_DM163_STATS.
+ */
+int dm163_get_stats(const struct device *dev, struct dm163_stats *stats);
+
+// Reset the counters of dm163_get_stats() and dm163_get_frame_stats()
+int dm163_reset_stats(const struct device *dev);
+
+#define DM163_BENCH_COUNT 4
+
+struct dm163_bench_result {
+  const char *name;
+  uint32_t ops;
+  // Cycles spent in the operations, see sys_clock_hw_cycles_per_sec()
+  uint64_t cycles;
+  // GPIO calls made while shifting out, one per transfer with SPI
+  uint32_t gpio_calls;
+  // Longest time the frames were locked against other producers
+  uint32_t max_lock_cycles;
+};
+
+/*
+ * Time iterations of each write path of the DM163 with k_cycle_get_32():
+ * led_write_channels() on a single LED, led_set_color() on every LED in
+ * turn, led_set_brightness(), and a refresh of the whole chain, or matrix
+ * when scanning. Each operation is timed until its frame is latched: when
+ * scanning, the scan is paused and the benchmark shifts out all the rows
+ * after each operation itself. The frames written are left displayed.
+ * Only available with CONFIG_DM163_BENCHMARK, which also makes the driver
+ * count its GPIO calls and lock hold times.
+ */
+int dm163_benchmark(const struct device *dev, uint32_t iterations,
+                    struct dm163_bench_result results[DM163_BENCH_COUNT]);
+
+#endif
@@ -0,0 +1,198 @@
+// Display API on top of the DM163 LED API, for the DM163 peripherals
+// driving an rgb_matrix.
+#define DT_DRV_COMPAT siti_dm163
+
+#include <zephyr/device.h>
+#include <zephyr/drivers/display.h>
+#include <zephyr/drivers/led.h>
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/sys/byteorder.h>
+
+#include "dm163.h"
+
+LOG_MODULE_REGISTER(dm163_display, LOG_LEVEL_DBG);
+
+struct dm163_display_config {
+  // DM163 chain driving the columns of the rgb_matrix
+  const struct device *dm163;
+  uint16_t width;
+  uint16_t height;
+};
+
+struct dm163_display_data {
+  enum display_pixel_format pixel_format;
+};
+
+#define SUPPORTED_PIXEL_FORMATS (PIXEL_FORMAT_RGB_888 | PIXEL_FORMAT_RGB_565)
+
+// Number of pixels converted at once before being handed to the DM163
+#define CHUNK_PIXELS DM163_CHIP_LEDS
+
+static int dm163_display_init(const struct device *dev);
+static int dm163_display_write(const struct device *dev, const uint16_t x,
+                               const uint16_t y,
+                               const struct display_buffer_descriptor *desc,
+                               const void *buf);
+static int dm163_display_set_brightness(const struct device *dev,
+                                        const uint8_t brightness);
+static void dm163_display_get_capabilities(const struct device *dev,
+                                           struct display_capabilities *caps);
+static int dm163_display_set_pixel_format(
+    const struct device *dev, const enum display_pixel_format pixel_format);
+
+static const struct display_driver_api dm163_display_api = {
+    .write = dm163_display_write,
+    .set_brightness = dm163_display_set_brightness,
+    .get_capabilities = dm163_display_get_capabilities,
+    .set_pixel_format = dm163_display_set_pixel_format,
+};
+
+// Display on the rgb_matrix of the DM163 peripheral with index i
+#define DM163_DISPLAY_DEFINE(i)                                                \
+  static const struct dm163_display_config dm163_display_config_##i = {        \
+      .dm163 = DEVICE_DT_INST_GET(i),                                          \
+      .width = DT_INST_PROP(i, chain_length) * DM163_CHIP_LEDS,                \
+      .height = DT_PROP_LEN(DT_INST_PHANDLE(i, rgb_matrix), rows_gpios),       \
+  };                                                                           \
+                                                                               \
+  static struct dm163_display_data dm163_display_data_##i = {                  \
+      .pixel_format = PIXEL_FORMAT_RGB_888,                                    \
+  };                                                                           \
+                                                                               \
+  DEVICE_DT_DEFINE(DT_INST_PHANDLE(i, rgb_matrix), &dm163_display_init, NULL,  \
+                   &dm163_display_data_##i, &dm163_display_config_##i,         \
+                   POST_KERNEL, CONFIG_DM163_DISPLAY_INIT_PRIORITY,            \
+                   &dm163_display_api);
+
+// The display device is the rgb_matrix node of the DM163 peripherals which
+// have one.
+#define DM163_DISPLAY_DEVICE(i) \
+  IF_ENABLED(DT_INST_NODE_HAS_PROP(i, rgb_matrix), (DM163_DISPLAY_DEFINE(i)))
+
+DT_INST_FOREACH_STATUS_OKAY(DM163_DISPLAY_DEVICE)
+
+static int dm163_display_init(const struct device *dev) {
+  const struct dm163_display_config *config = dev->config;
+
+  if (!device_is_ready(config->dm163)) {
+    LOG_ERR("device %s is not ready", config->dm163->name);
+    return -ENODEV;
+  }
+  LOG_INF("display %s is %dx%d", dev->name, config->width, config->height);
+  return 0;
+}
+
+/*
+ * Convert pixels to the red, green and blue channels of as many LEDs.
+ * RGB565 pixels are big endian, as in the other Zephyr display drivers.
+ */
+static void convert_pixels(enum display_pixel_format pixel_format,
+                           const uint8_t *pixels, uint8_t *channels,
+                           int count) {
+  for (int i = 0; i < count; i++, channels += 3) {
+    if (pixel_format == PIXEL_FORMAT_RGB_888) {
+      memcpy(channels, &pixels[i * 3], 3);
+    } else {
+      uint16_t pixel = sys_get_be16(&pixels[i * 2]);
+      uint8_t r = (pixel >> 11) & 0x1f;
+      uint8_t g = (pixel >> 5) & 0x3f;
+      uint8_t b = pixel & 0x1f;
+
+      // Replicate the high bits so that full scale stays 0xff
+      channels[0] = (r << 3) | (r >> 2);
+      channels[1] = (g << 2) | (g >> 4);
+      channels[2] = (b << 3) | (b >> 2);
+    }
+  }
+}
+
+/*
+ * Only the pixels of the rectangle are converted and written to the rows
+ * they cover, as a single DM163 update so that the blit shows up in one
+ * frame.
+ */
+static int dm163_display_write(const struct device *dev, const uint16_t x,
+                               const uint16_t y,
+                               const struct display_buffer_descriptor *desc,
+                               const void *buf) {
+  const struct dm163_display_config *config = dev->config;
+  struct dm163_display_data *data = dev->data;
+  size_t pixel_size = data->pixel_format == PIXEL_FORMAT_RGB_888 ? 3 : 2;
+  uint8_t channels[CHUNK_PIXELS * 3];
+  int ret, commit_ret;
+
+  if (x + desc->width > config->width || y + desc->height > config->height ||
+      desc->pitch < desc->width) {
+    return -EINVAL;
+  }
+  if (desc->height > 0 &&
+      desc->buf_size < ((desc->height - 1) * desc->pitch + desc->width) *
+                           pixel_size) {
+    return -EINVAL;
+  }
+
+  ret = dm163_begin_update(config->dm163);
+  if (ret) return ret;
+
+  for (uint16_t row = 0; row < desc->height && !ret; row++) {
+    const uint8_t *pixels =
+        (const uint8_t *)buf + row * desc->pitch * pixel_size;
+    uint32_t led = (y + row) * config->width + x;
+
+    for (uint16_t done = 0; done < desc->width && !ret;) {
+      int count = MIN(desc->width - done, CHUNK_PIXELS);
+
+      convert_pixels(data->pixel_format, &pixels[done * pixel_size], channels,
+                     count);
+      ret = led_write_channels(config->dm163, (led + done) * 3, count * 3,
+                               channels);
+      done += count;
+    }
+  }
+
+  commit_ret = dm163_commit(config->dm163);
+  return ret ? ret : commit_ret;
+}
+
+// The brightness of each column is set through the DM163 dot correction.
+static int dm163_display_set_brightness(const struct device *dev,
+                                        const uint8_t brightness) {
+  const struct dm163_display_config *config = dev->config;
+  int ret = dm163_begin_update(config->dm163), commit_ret;
+
+  if (ret) return ret;
+
+  for (uint16_t column = 0; column < config->width && !ret; column++) {
+    ret = led_set_brightness(config->dm163, column, brightness * 100 / 255);
+  }
+
+  commit_ret = dm163_commit(config->dm163);
+  return ret ? ret : commit_ret;
+}
+
+static void dm163_display_get_capabilities(const struct device *dev,
+                                           struct display_capabilities *caps) {
+  const struct dm163_display_config *config = dev->config;
+  struct dm163_display_data *data = dev->data;
+
+  memset(caps, 0, sizeof(*caps));
+  caps->x_resolution = config->width;
+  caps->y_resolution = config->height;
+  caps->supported_pixel_formats = SUPPORTED_PIXEL_FORMATS;
+  caps->current_pixel_format = data->pixel_format;
+  caps->current_orientation = DISPLAY_ORIENTATION_NORMAL;
+}
+
+static int dm163_display_set_pixel_format(
+    const struct device *dev, const enum display_pixel_format pixel_format) {
+  struct dm163_display_data *data = dev->data;
+
+  if (pixel_format != PIXEL_FORMAT_RGB_888 &&
+      pixel_format != PIXEL_FORMAT_RGB_565) {
+    return -ENOTSUP;
+  }
+
+  data->pixel_format = pixel_format;
+  return 0;
+}
@@ -0,0 +1,430 @@
+// Emulator of the DM163 chains wired to gpio_emul pins, see dm163_emul.h
+#define DT_DRV_COMPAT siti_dm163
+
+#include "dm163_emul.h"
+
+#include <zephyr/device.h>
+#include <zephyr/drivers/gpio.h>
+#include <zephyr/init.h>
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+
+#include "dm163.h"
+
+LOG_MODULE_REGISTER(dm163_emul, LOG_LEVEL_DBG);
+
+#define CHIP_CHANNELS (DM163_CHIP_LEDS * 3)
+#define CHANNEL_BITS 8
+#define BRIGHTNESS_BITS 6
+
+/*
+ * Shift register of a bank of the whole chain, one bit per byte. The
+ * oldest bit, the first shifted in, has been passed on to the last DM163.
+ */
+struct dm163_shift_register {
+  uint8_t *bits;
+  uint32_t size;
+  // Position of the next bit, and so of the oldest one
+  uint32_t head;
+};
+
+struct dm163_emul_config {
+  // Emulated DM163 device
+  const struct device *dm163;
+  struct gpio_dt_spec gck;
+  struct gpio_dt_spec lat;
+  struct gpio_dt_spec rst;
+  struct gpio_dt_spec selbk;
+  struct gpio_dt_spec sin;
+  // Rows of the rgb_matrix driven by the chain, NULL without one
+  const struct gpio_dt_spec *rows;
+  uint8_t num_rows;
+  uint16_t num_channels;
+};
+
+struct dm163_emul_data;
+
+// Watch of a row of the rgb_matrix
+struct dm163_emul_row {
+  struct gpio_callback cb;
+  struct dm163_emul_data *data;
+  uint8_t row;
+};
+
+struct dm163_emul_data {
+  const struct dm163_emul_config *config;
+  struct dm163_shift_register channels_register;
+  struct dm163_shift_register brightness_register;
+  // Banks latched by the chain
+  uint8_t *channels;
+  uint8_t *brightness;
+  // Channels latched when each row of the rgb_matrix was last turned on
+  uint8_t *matrix;
+  struct dm163_emul_row *row_watches;
+  struct gpio_callback gck_cb;
+  struct gpio_callback lat_cb;
+  struct gpio_callback rst_cb;
+  // Flush being shifted in, and the cycle counter at its first edge
+  struct dm163_emul_flush flush;
+  uint32_t flush_start;
+  // Guards the latched banks and the stats
+  struct k_spinlock lock;
+  struct dm163_emul_stats stats;
+};
+
+static int dm163_emul_init(void);
+static struct dm163_emul_data *find_emul(const struct device *dev);
+
+#define DM163_EMUL_HAS_MATRIX(i) DT_INST_NODE_HAS_PROP(i, rgb_matrix)
+#define DM163_EMUL_MATRIX(i) DT_INST_PHANDLE(i, rgb_matrix)
+#define DM163_EMUL_NUM_ROWS(i) DT_PROP_LEN(DM163_EMUL_MATRIX(i), rows_gpios)
+
+// Rows of the rgb_matrix of the DM163 peripheral with index i
+#define DM163_EMUL_MATRIX_DEFINE(i)                                            \
+  static const struct gpio_dt_spec dm163_emul_rows_##i[] = {                   \
+      DT_FOREACH_PROP_ELEM_SEP(DM163_EMUL_MATRIX(i), rows_gpios,               \
+                               GPIO_DT_SPEC_GET_BY_IDX, (, ))};                \
+  static struct dm163_emul_row dm163_emul_row_watches_##i[DM163_EMUL_NUM_ROWS( \
+      i)];                                                                     \
+  static uint8_t dm163_emul_matrix_##i[DM163_EMUL_NUM_ROWS(i) *                \
+                                       DT_INST_PROP(i, chain_length) *         \
+                                       CHIP_CHANNELS];
+
+// Emulator of the DM163 peripheral with index i, for its whole chain
+#define DM163_EMUL_DEFINE(i)                                                   \
+  IF_ENABLED(DM163_EMUL_HAS_MATRIX(i), (DM163_EMUL_MATRIX_DEFINE(i)))          \
+  static uint8_t dm163_emul_channels_bits_##i[DT_INST_PROP(i, chain_length) *  \
+                                              CHIP_CHANNELS * CHANNEL_BITS];   \
+  static uint8_t                                                               \
+      dm163_emul_brightness_bits_##i[DT_INST_PROP(i, chain_length) *           \
+                                     CHIP_CHANNELS * BRIGHTNESS_BITS];         \
+  static uint8_t dm163_emul_channels_##i[DT_INST_PROP(i, chain_length) *       \
+                                         CHIP_CHANNELS];                       \
+  static uint8_t dm163_emul_brightness_##i[DT_INST_PROP(i, chain_length) *     \
+                                           CHIP_CHANNELS];                     \
+                                                                               \
+  static const struct dm163_emul_config dm163_emul_config_##i = {              \
+      .dm163 = DEVICE_DT_INST_GET(i),                                          \
+      .gck = GPIO_DT_SPEC_GET_OR(DT_DRV_INST(i), gck_gpios, {0}),              \
+      .lat = GPIO_DT_SPEC_GET(DT_DRV_INST(i), lat_gpios),                      \
+      .rst = GPIO_DT_SPEC_GET(DT_DRV_INST(i), rst_gpios),                      \
+      .selbk = GPIO_DT_SPEC_GET(DT_DRV_INST(i), selbk_gpios),                  \
+      .sin = GPIO_DT_SPEC_GET_OR(DT_DRV_INST(i), sin_gpios, {0}),              \
+      IF_ENABLED(DM163_EMUL_HAS_MATRIX(i),                                     \
+                 (.rows = dm163_emul_rows_##i,                                 \
+                  .num_rows = DM163_EMUL_NUM_ROWS(i), ))                       \
+      .num_channels = DT_INST_PROP(i, chain_length) * CHIP_CHANNELS,           \
+  };                                                                           \
+                                                                               \
+  static struct dm163_emul_data dm163_emul_data_##i = {                        \
+      .config = &dm163_emul_config_##i,                                        \
+      .channels_register = {.bits = dm163_emul_channels_bits_##i,              \
+                            .size = sizeof(dm163_emul_channels_bits_##i)},     \
+      .brightness_register = {.bits = dm163_emul_brightness_bits_##i,          \
+                              .size = sizeof(dm163_emul_brightness_bits_##i)}, \
+      .channels = dm163_emul_channels_##i,                                     \
+      .brightness = dm163_emul_brightness_##i,                                 \
+      IF_ENABLED(DM163_EMUL_HAS_MATRIX(i),                                     \
+                 (.matrix = dm163_emul_matrix_##i,                             \
+                  .row_watches = dm163_emul_row_watches_##i, ))                \
+  };
+
+DT_INST_FOREACH_STATUS_OKAY(DM163_EMUL_DEFINE)
+
+#define DM163_EMUL_DATA(i) &dm163_emul_data_##i,
+
+static struct dm163_emul_data *const dm163_emuls[] = {
+    DT_INST_FOREACH_STATUS_OKAY(DM163_EMUL_DATA)};
+
+// Attach once the DM163 devices have configured their pins
+SYS_INIT(dm163_emul_init, POST_KERNEL, CONFIG_DM163_EMUL_INIT_PRIORITY);
+
+/*
+ * Decode the last bits of a shift register into a bank, the way the chain
+ * latches it: the oldest bits are the last channel, MSB first.
+ */
+static void latch_bank(const struct dm163_shift_register *reg, uint8_t *bank,
+                       int count, int bits) {
+  uint32_t pos = reg->head;
+
+  for (int i = count - 1; i >= 0; i--) {
+    uint8_t value = 0;
+
+    for (int b = 0; b < bits; b++) {
+      value = (value << 1) | reg->bits[pos];
+      pos = (pos + 1) % reg->size;
+    }
+    bank[i] = value;
+  }
+}
+
+// Shift a bit into the chain, on a GCK rising edge or a bit of SPI transfer
+static void shift_in(struct dm163_emul_data *data, uint8_t bit) {
+  const struct dm163_emul_config *config = data->config;
+  // SELBK selects the bank shifted in, the channels one when active.
+  struct dm163_shift_register *reg = gpio_pin_get_dt(&config->selbk)
+                                         ? &data->channels_register
+                                         : &data->brightness_register;
+
+  if (data->flush.gck_edges == 0) data->flush_start = k_cycle_get_32();
+  data->flush.gck_edges++;
+
+  reg->bits[reg->head] = bit;
+  reg->head = (reg->head + 1) % reg->size;
+}
+
+static void gck_rising_edge(const struct device *port, struct gpio_callback *cb,
+                            gpio_port_pins_t pins) {
+  struct dm163_emul_data *data =
+      CONTAINER_OF(cb, struct dm163_emul_data, gck_cb);
+
+  shift_in(data, gpio_pin_get_dt(&data->config->sin));
+}
+
+static void lat_rising_edge(const struct device *port, struct gpio_callback *cb,
+                            gpio_port_pins_t pins) {
+  struct dm163_emul_data *data =
+      CONTAINER_OF(cb, struct dm163_emul_data, lat_cb);
+  const struct dm163_emul_config *config = data->config;
+  bool brightness = !gpio_pin_get_dt(&config->selbk);
+  k_spinlock_key_t key = k_spin_lock(&data->lock);
+
+  if (brightness) {
+    latch_bank(&data->brightness_register, data->brightness,
+               config->num_channels, BRIGHTNESS_BITS);
+    data->stats.brightness_latches++;
+  } else {
+    latch_bank(&data->channels_register, data->channels, config->num_channels,
+               CHANNEL_BITS);
+    data->stats.channels_latches++;
+  }
+
+  data->flush.bytes = data->flush.gck_edges / 8;
+  data->flush.brightness = brightness;
+  if (data->flush.gck_edges) {
+    data->flush.cycles = k_cycle_get_32() - data->flush_start;
+  }
+  data->stats.gck_edges += data->flush.gck_edges;
+  data->stats.cycles += data->flush.cycles;
+  data->stats.last = data->flush;
+  k_spin_unlock(&data->lock, key);
+
+  memset(&data->flush, 0, sizeof(data->flush));
+}
+
+/*
+ * The driver turns the next row on right after latching its channels, so
+ * they are what the row shows until it is turned off.
+ */
+static void row_active(const struct device *port, struct gpio_callback *cb,
+                       gpio_port_pins_t pins) {
+  struct dm163_emul_row *watch = CONTAINER_OF(cb, struct dm163_emul_row, cb);
+  struct dm163_emul_data *data = watch->data;
+  uint16_t num_channels = data->config->num_channels;
+  k_spinlock_key_t key = k_spin_lock(&data->lock);
+
+  memcpy(&data->matrix[watch->row * num_channels], data->channels,
+         num_channels);
+  k_spin_unlock(&data->lock, key);
+}
+
+// A reset clears both the shift registers and the latched banks.
+static void rst_active(const struct device *port, struct gpio_callback *cb,
+                       gpio_port_pins_t pins) {
+  struct dm163_emul_data *data =
+      CONTAINER_OF(cb, struct dm163_emul_data, rst_cb);
+  const struct dm163_emul_config *config = data->config;
+  k_spinlock_key_t key = k_spin_lock(&data->lock);
+
+  memset(data->channels_register.bits, 0, data->channels_register.size);
+  memset(data->brightness_register.bits, 0, data->brightness_register.size);
+  memset(data->channels, 0, config->num_channels);
+  memset(data->brightness, 0, config->num_channels);
+  if (data->matrix) {
+    memset(data->matrix, 0, config->num_rows * config->num_channels);
+  }
+  k_spin_unlock(&data->lock, key);
+}
+
+/*
+ * Watch a pin of the DM163. gpio_emul loops the output value of a pin
+ * configured as both input and output back to its input, which raises the
+ * interrupt. Configuring with the dt flags keeps the polarity the driver
+ * set up.
+ */
+static int watch_pin(const struct gpio_dt_spec *spec, struct gpio_callback *cb,
+                     gpio_callback_handler_t handler) {
+  int ret = gpio_pin_configure_dt(spec, GPIO_INPUT | GPIO_OUTPUT);
+
+  if (ret) return ret;
+  if (!handler) return 0;
+
+  gpio_init_callback(cb, handler, BIT(spec->pin));
+  ret = gpio_add_callback(spec->port, cb);
+  if (ret) return ret;
+  return gpio_pin_interrupt_configure_dt(spec, GPIO_INT_EDGE_TO_ACTIVE);
+}
+
+static int dm163_emul_init(void) {
+  for (int i = 0; i < ARRAY_SIZE(dm163_emuls); i++) {
+    struct dm163_emul_data *data = dm163_emuls[i];
+    const struct dm163_emul_config *config = data->config;
+    int ret;
+
+    if (!device_is_ready(config->dm163)) continue;
+
+    // Without sin/gck GPIOs, the bits come from the SPI emulator instead.
+    ret = watch_pin(&config->selbk, NULL, NULL);
+    if (!ret && config->sin.port && config->gck.port) {
+      ret = watch_pin(&config->sin, NULL, NULL);
+      if (!ret) ret = watch_pin(&config->gck, &data->gck_cb, gck_rising_edge);
+    }
+    if (!ret) ret = watch_pin(&config->lat, &data->lat_cb, lat_rising_edge);
+    if (!ret) ret = watch_pin(&config->rst, &data->rst_cb, rst_active);
+    for (int row = 0; row < config->num_rows && !ret; row++) {
+      struct dm163_emul_row *watch = &data->row_watches[row];
+
+      watch->data = data;
+      watch->row = row;
+      ret = watch_pin(&config->rows[row], &watch->cb, row_active);
+    }
+    if (ret) {
+      LOG_ERR("cannot watch the pins of %s (%d), are they on gpio_emul?",
+              config->dm163->name, ret);
+      return ret;
+    }
+    LOG_INF("emulating %s", config->dm163->name);
+  }
+  return 0;
+}
+
+static struct dm163_emul_data *find_emul(const struct device *dev) {
+  for (int i = 0; i < ARRAY_SIZE(dm163_emuls); i++) {
+    if (dm163_emuls[i]->config->dm163 == dev) return dm163_emuls[i];
+  }
+  return NULL;
+}
+
+static int copy_bank(struct dm163_emul_data *data, const uint8_t *bank,
+                     size_t size, uint8_t *values, size_t count) {
+  k_spinlock_key_t key;
+
+  if (count != size) return -EINVAL;
+
+  key = k_spin_lock(&data->lock);
+  memcpy(values, bank, count);
+  k_spin_unlock(&data->lock, key);
+  return 0;
+}
+
+int dm163_emul_get_channels(const struct device *dev, uint8_t *channels,
+                            size_t count) {
+  struct dm163_emul_data *data = find_emul(dev);
+  const struct dm163_emul_config *config;
+
+  if (!data) return -ENODEV;
+  config = data->config;
+  if (data->matrix && count != config->num_channels) {
+    return copy_bank(data, data->matrix,
+                     config->num_rows * config->num_channels, channels, count);
+  }
+  return copy_bank(data, data->channels, config->num_channels, channels,
+                   count);
+}
+
+int dm163_emul_get_brightness(const struct device *dev, uint8_t *brightness,
+                              size_t count) {
+  struct dm163_emul_data *data = find_emul(dev);
+
+  if (!data) return -ENODEV;
+  return copy_bank(data, data->brightness, data->config->num_channels,
+                   brightness, count);
+}
+
+int dm163_emul_get_stats(const struct device *dev,
+                         struct dm163_emul_stats *stats) {
+  struct dm163_emul_data *data = find_emul(dev);
+  k_spinlock_key_t key;
+
+  if (!data) return -ENODEV;
+
+  key = k_spin_lock(&data->lock);
+  *stats = data->stats;
+  k_spin_unlock(&data->lock, key);
+  return 0;
+}
+
+int dm163_emul_reset_stats(const struct device *dev) {
+  struct dm163_emul_data *data = find_emul(dev);
+  k_spinlock_key_t key;
+
+  if (!data) return -ENODEV;
+
+  key = k_spin_lock(&data->lock);
+  memset(&data->stats, 0, sizeof(data->stats));
+  k_spin_unlock(&data->lock, key);
+  return 0;
+}
+
+#if defined(CONFIG_SPI_EMUL) && DT_HAS_COMPAT_STATUS_OKAY(siti_dm163_spi_emul)
+/*
+ * Sink of the SPI transfers of a DM163 whose SIN/GCK are wired to a SPI
+ * controller: each bit sent, MSB first, is shifted into the chain of the
+ * DM163 referenced by the node, like on a GCK rising edge.
+ */
+#include <zephyr/drivers/emul.h>
+#include <zephyr/drivers/spi_emul.h>
+
+#undef DT_DRV_COMPAT
+#define DT_DRV_COMPAT siti_dm163_spi_emul
+
+struct dm163_spi_emul_config {
+  const struct device *dm163;
+};
+
+static int dm163_spi_emul_io(const struct emul *target,
+                             const struct spi_config *config,
+                             const struct spi_buf_set *tx_bufs,
+                             const struct spi_buf_set *rx_bufs) {
+  const struct dm163_spi_emul_config *spi_config = target->cfg;
+  struct dm163_emul_data *data = find_emul(spi_config->dm163);
+
+  if (!data || !tx_bufs) return -EIO;
+
+  for (size_t i = 0; i < tx_bufs->count; i++) {
+    const struct spi_buf *buf = &tx_bufs->buffers[i];
+    const uint8_t *bytes = buf->buf;
+
+    for (size_t j = 0; j < buf->len; j++) {
+      uint8_t byte = bytes ? bytes[j] : 0;
+
+      for (int b = 7; b >= 0; b--) shift_in(data, (byte >> b) & 0x1);
+    }
+  }
+  return 0;
+}
+
+static int dm163_spi_emul_init(const struct emul *target,
+                               const struct device *parent) {
+  return 0;
+}
+
+static int dm163_spi_emul_device_init(const struct device *dev) { return 0; }
+
+static const struct spi_emul_api dm163_spi_emul_api = {
+    .io = dm163_spi_emul_io,
+};
+
+// The device is only needed by the emulator, nothing talks to it.
+#define DM163_SPI_EMUL_DEFINE(i)                                             \
+  static const struct dm163_spi_emul_config dm163_spi_emul_config_##i = {    \
+      .dm163 = DEVICE_DT_GET(DT_INST_PHANDLE(i, dm163)),                     \
+  };                                                                         \
+                                                                             \
+  DEVICE_DT_INST_DEFINE(i, dm163_spi_emul_device_init, NULL, NULL, NULL,     \
+                        POST_KERNEL, CONFIG_SPI_INIT_PRIORITY, NULL);        \
+  EMUL_DT_INST_DEFINE(i, dm163_spi_emul_init, NULL,                          \
+                      &dm163_spi_emul_config_##i, &dm163_spi_emul_api, NULL);
+
+DT_INST_FOREACH_STATUS_OKAY(DM163_SPI_EMUL_DEFINE)
+#endif
@@ -0,0 +1,54 @@
+#ifndef DM163_EMUL_H
+#define DM163_EMUL_H
+
+#include <zephyr/device.h>
+
+/*
+ * Emulator of the DM163 chains whose pins are on gpio_emul ports. It
+ * watches SIN, GCK, LAT, SELBK and RST as the driver toggles them, shifts
+ * the bits in and latches them like the chips do. It also watches the rows
+ * of the rgb_matrix, to tell which row shows the latched channels. When
+ * SIN/GCK are wired to a SPI controller instead, a "siti,dm163-spi-emul"
+ * node on a SPI emulator shifts the bits of each transfer in. It only
+ * sees the flushes done after it attached, once the DM163 devices are
+ * initialized.
+ */
+
+struct dm163_emul_flush {
+  // GCK rising edges, or bits sent through SPI, before the latch
+  uint32_t gck_edges;
+  uint32_t bytes;
+  // Cycles from the first GCK edge to the latch
+  uint32_t cycles;
+  // Whether the dot correction bank was latched, rather than the channels
+  bool brightness;
+};
+
+struct dm163_emul_stats {
+  uint32_t channels_latches;
+  uint32_t brightness_latches;
+  uint64_t gck_edges;
+  uint64_t cycles;
+  struct dm163_emul_flush last;
+};
+
+/*
+ * Copy the latched channels of the chain driven by the DM163 device dev,
+ * in the order of the LED API. count must be the number of channels of the
+ * chain. When the chain drives an rgb_matrix, count may instead be that of
+ * the whole matrix, to get the channels each row was last lit with.
+ * Return -ENODEV if dev is not emulated.
+ */
+int dm163_emul_get_channels(const struct device *dev, uint8_t *channels,
+                            size_t count);
+
+// Same as dm163_emul_get_channels() for the 6-bit dot correction bank
+int dm163_emul_get_brightness(const struct device *dev, uint8_t *brightness,
+                              size_t count);
+
+int dm163_emul_get_stats(const struct device *dev,
+                         struct dm163_emul_stats *stats);
+
+int dm163_emul_reset_stats(const struct device *dev);
+
+#endif
@@ -0,0 +1,133 @@
+// Shell commands of the DM163 driver
+#define DT_DRV_COMPAT siti_dm163
+
+#include <stdlib.h>
+#include <string.h>
+#include <zephyr/device.h>
+#include <zephyr/kernel.h>
+#include <zephyr/shell/shell.h>
+
+#include "dm163.h"
+
+#define DEFAULT_BENCH_ITERATIONS 100
+
+#define DM163_DEVICE_GET(i) DEVICE_DT_INST_GET(i),
+
+static const struct device *const dm163_devices[] = {
+    DT_INST_FOREACH_STATUS_OKAY(DM163_DEVICE_GET)};
+
+#ifdef CONFIG_DM163_BENCHMARK
+/*
+ * Only the DM163 instances are looked up, as the benchmark uses the data
+ * of the device as the one of a DM163.
+ */
+static const struct device *get_dm163(const struct shell *sh,
+                                      const char *name) {
+  for (int i = 0; i < ARRAY_SIZE(dm163_devices); i++) {
+    const struct device *dev = dm163_devices[i];
+
+    if (strcmp(dev->name, name) != 0) continue;
+    if (!device_is_ready(dev)) {
+      shell_error(sh, "device %s is not ready", name);
+      return NULL;
+    }
+    return dev;
+  }
+  shell_error(sh, "%s is not a DM163 device", name);
+  return NULL;
+}
+
+/*
+ * One line per benchmark, as key=value pairs, so that the results can be
+ * parsed from a log.
+ */
+static int cmd_bench(const struct shell *sh, size_t argc, char **argv) {
+  const struct device *dev = get_dm163(sh, argv[1]);
+  uint32_t iterations = DEFAULT_BENCH_ITERATIONS;
+  struct dm163_bench_result results[DM163_BENCH_COUNT];
+  uint32_t cycles_per_sec = sys_clock_hw_cycles_per_sec();
+  int ret;
+
+  if (!dev) return -ENODEV;
+  if (argc > 2) iterations = strtoul(argv[2], NULL, 0);
+
+  ret = dm163_benchmark(dev, iterations, results);
+  if (ret) {
+    shell_error(sh, "benchmark of %s failed (%d)", dev->name, ret);
+    return ret;
+  }
+
+  for (int b = 0; b < DM163_BENCH_COUNT; b++) {
+    const struct dm163_bench_result *result = &results[b];
+    uint64_t cycles = MAX(result->cycles, 1);
+
+    shell_print(sh,
+                "dm163_bench name=%s ops=%u cycles=%llu ops_per_s=%llu "
+                "gpio_calls_per_op=%u max_lock_cycles=%u",
+                result->name, result->ops,
+                (unsigned long long)result->cycles,
+                (unsigned long long)result->ops * cycles_per_sec / cycles,
+                result->gpio_calls / result->ops, result->max_lock_cycles);
+  }
+  return 0;
+}
+#endif
+
+#ifdef CONFIG_DM163_STATS
+static void print_stats(const struct shell *sh, const struct device *dev) {
+  struct dm163_stats stats;
+  uint32_t avg_flush_cycles;
+
+  dm163_get_stats(dev, &stats);
+  avg_flush_cycles =
+      stats.flushes ? stats.total_flush_cycles / stats.flushes : 0;
+
+  shell_print(sh, "%s:", dev->name);
+  shell_print(sh, "  flushes: %u (%llu bytes)", stats.flushes,
+              (unsigned long long)stats.bytes);
+  shell_print(sh, "  flush cycles: min %u avg %u max %u",
+              stats.min_flush_cycles, avg_flush_cycles,
+              stats.max_flush_cycles);
+  shell_print(sh, "  longest lock: %u cycles", stats.max_lock_cycles);
+  shell_print(sh, "  skipped writes: %u", stats.skipped_writes);
+  shell_print(sh, "  frames dropped: %u torn: %u", stats.frames_dropped,
+              stats.frames_torn);
+}
+
+static int cmd_stats(const struct shell *sh, size_t argc, char **argv) {
+  bool reset = argc > 1;
+
+  if (reset && strcmp(argv[1], "reset") != 0) {
+    shell_error(sh, "unknown argument %s", argv[1]);
+    return -EINVAL;
+  }
+
+  for (int i = 0; i < ARRAY_SIZE(dm163_devices); i++) {
+    const struct device *dev = dm163_devices[i];
+
+    if (!device_is_ready(dev)) continue;
+    if (reset) {
+      dm163_reset_stats(dev);
+    } else {
+      print_stats(sh, dev);
+    }
+  }
+  return 0;
+}
+#endif
+
+SHELL_STATIC_SUBCMD_SET_CREATE(
+    dm163_cmds,
+    SHELL_COND_CMD_ARG(CONFIG_DM163_BENCHMARK, bench, NULL,
+                       "Time the write paths, overwriting the displayed "
+                       "frames\n"
+                       "usage: dm163 bench <device> [iterations]",
+                       cmd_bench, 2, 1),
+    SHELL_COND_CMD_ARG(CONFIG_DM163_STATS, stats, NULL,
+                       "Show the counters of the DM163 devices, or reset "
+                       "them\n"
+                       "usage: dm163 stats [reset]",
+                       cmd_stats, 1, 1),
+    SHELL_SUBCMD_SET_END);
+
+SHELL_CMD_REGISTER(dm163, &dm163_cmds, "DM163 LED driver commands", NULL);
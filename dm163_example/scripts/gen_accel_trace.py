@@ -0,0 +1,65 @@
+#!/usr/bin/env python3
+"""Convert a recorded accelerometer trace to a C array, for the replay of
+the spirit level on native_sim.
+
+The trace is a CSV file with a header and one sample per line:
+
+    t_us,x,y,z
+    0,12,-40,16390
+    19231,15,-38,16401
+    ...
+
+t_us is the time of the sample since the start of the trace, and x, y, z
+the raw LSM6DSL measures, in LSB at +/- 2 g.
+"""
+
+import argparse
+import csv
+
+COLUMNS = ["t_us", "x", "y", "z"]
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description=__doc__,
+        formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("input")
+    parser.add_argument("--output", required=True)
+    args = parser.parse_args()
+
+    samples = []
+    with open(args.input, newline="") as f:
+        reader = csv.DictReader(f)
+        if reader.fieldnames != COLUMNS:
+            parser.error(f"the columns must be {','.join(COLUMNS)}")
+        previous_t = -1
+        for line, row in enumerate(reader, start=2):
+            sample = [int(row[column]) for column in COLUMNS]
+            if sample[0] <= previous_t:
+                parser.error(f"line {line}: t_us does not increase")
+            if any(not -32768 <= value < 32768 for value in sample[1:]):
+                parser.error(f"line {line}: measure out of the int16 range")
+            previous_t = sample[0]
+            samples.append(sample)
+    if not samples:
+        parser.error("the trace has no samples")
+
+    body = "\n".join(f"    {{{t}, {{{x}, {y}, {z}}}}},"
+                     for t, x, y, z in samples)
+
+    with open(args.output, "w") as output:
+        output.write(f"""\
+// Generated by gen_accel_trace.py from {args.input.split('/')[-1]},
+// do not edit.
+#include "accel_trace.h"
+
+const struct accel_trace_sample accel_trace[] = {{
+{body}
+}};
+
+const size_t accel_trace_len = {len(samples)};
+""")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,21 @@
+#ifndef ACCEL_TRACE_H
+#define ACCEL_TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Recorded accelerometer sample, generated from a CSV trace by
+ * gen_accel_trace.py
+ */
+struct accel_trace_sample {
+  // time since the start of the trace
+  uint32_t t_us;
+  // raw X, Y and Z measures
+  int16_t acceleration[3];
+};
+
+extern const struct accel_trace_sample accel_trace[];
+extern const size_t accel_trace_len;
+
+#endif
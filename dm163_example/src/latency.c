@@ -0,0 +1,115 @@
+#include "latency.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <zephyr/device.h>
+#include <zephyr/kernel.h>
+#include <zephyr/shell/shell.h>
+
+#include "../dm163_module/zephyr/dm163.h"
+
+// number of traced samples kept to compute the percentiles
+#define LATENCY_HISTORY 64
+
+static const char *const stage_names[LATENCY_STAGES] = {
+    "irq", "i2c_done", "position", "channels", "flush_start", "latch",
+};
+
+/*
+ * Timestamps of the sample being traced, and latencies since the
+ * interrupt of the last traced samples, per stage
+ */
+static uint32_t timestamps[LATENCY_STAGES];
+static enum latency_stage next_stage = LATENCY_IRQ;
+static uint32_t latencies[LATENCY_HISTORY][LATENCY_STAGES];
+static uint32_t traced_samples;
+static struct k_spinlock latency_lock;
+
+void latency_trace(enum latency_stage stage) {
+  uint32_t now = k_cycle_get_32();
+  k_spinlock_key_t key = k_spin_lock(&latency_lock);
+
+  if (stage == LATENCY_IRQ && next_stage <= LATENCY_CHANNELS) {
+    next_stage = LATENCY_IRQ;
+  } else if (stage == LATENCY_POSITION && next_stage == LATENCY_CHANNELS) {
+    // a new position without a led change, keep the latest one
+    next_stage = LATENCY_POSITION;
+  }
+
+  if (stage == next_stage) {
+    timestamps[stage] = now;
+    next_stage = stage + 1;
+
+    if (next_stage == LATENCY_STAGES) {
+      uint32_t *sample = latencies[traced_samples % LATENCY_HISTORY];
+
+      for (int i = 0; i < LATENCY_STAGES; i++) {
+        sample[i] = timestamps[i] - timestamps[LATENCY_IRQ];
+      }
+      traced_samples++;
+      next_stage = LATENCY_IRQ;
+    }
+  }
+  k_spin_unlock(&latency_lock, key);
+}
+
+static int compare_cycles(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *)a;
+  uint32_t y = *(const uint32_t *)b;
+
+  return (x > y) - (x < y);
+}
+
+static void print_percentiles(const struct shell *sh) {
+  static uint32_t sorted[LATENCY_HISTORY];
+  uint32_t count;
+
+  k_spinlock_key_t key = k_spin_lock(&latency_lock);
+  count = MIN(traced_samples, LATENCY_HISTORY);
+  k_spin_unlock(&latency_lock, key);
+
+  if (count == 0) {
+    shell_print(sh, "no sample traced yet");
+    return;
+  }
+
+  // one line per stage, in microseconds since the interrupt
+  for (int stage = LATENCY_I2C_DONE; stage < LATENCY_STAGES; stage++) {
+    key = k_spin_lock(&latency_lock);
+    for (int i = 0; i < count; i++) sorted[i] = latencies[i][stage];
+    k_spin_unlock(&latency_lock, key);
+
+    qsort(sorted, count, sizeof(sorted[0]), compare_cycles);
+    shell_print(sh,
+                "latency stage=%s samples=%u p50_us=%u p90_us=%u p99_us=%u "
+                "max_us=%u",
+                stage_names[stage], count,
+                k_cyc_to_us_floor32(sorted[count * 50 / 100]),
+                k_cyc_to_us_floor32(sorted[count * 90 / 100]),
+                k_cyc_to_us_floor32(sorted[count * 99 / 100]),
+                k_cyc_to_us_floor32(sorted[count - 1]));
+  }
+}
+
+static int cmd_latency(const struct shell *sh, size_t argc, char **argv) {
+  if (argc > 1) {
+    if (strcmp(argv[1], "reset") != 0) {
+      shell_error(sh, "unknown argument %s", argv[1]);
+      return -EINVAL;
+    }
+    k_spinlock_key_t key = k_spin_lock(&latency_lock);
+    traced_samples = 0;
+    next_stage = LATENCY_IRQ;
+    k_spin_unlock(&latency_lock, key);
+    return 0;
+  }
+
+  print_percentiles(sh);
+  return 0;
+}
+
+SHELL_CMD_ARG_REGISTER(latency, NULL,
+                       "Show the percentiles of the sample to latch latency "
+                       "of each stage, or reset them\n"
+                       "usage: latency [reset]",
+                       cmd_latency, 1, 1);
@@ -0,0 +1,31 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+/*
+ * Stages of the spirit level pipeline, from the accelerometer interrupt to
+ * the latch of the leds showing the new position
+ */
+enum latency_stage {
+  LATENCY_IRQ,
+  LATENCY_I2C_DONE,
+  LATENCY_POSITION,
+  LATENCY_CHANNELS,
+  LATENCY_FLUSH_START,
+  LATENCY_LATCH,
+  LATENCY_STAGES,
+};
+
+#ifdef CONFIG_SPIRIT_LEVEL_LATENCY
+/*
+ * Timestamp a stage of the sample being traced. A new sample is traced
+ * from each interrupt, unless the previous one has already reached the
+ * channels update: a sample which did not move the spirit to another led
+ * never shows up, so it is dropped. The "latency" shell command shows the
+ * percentiles of each stage.
+ */
+void latency_trace(enum latency_stage stage);
+#else
+#define latency_trace(stage)
+#endif
+
+#endif
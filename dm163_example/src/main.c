@@ -8,26 +8,16 @@
 #include "spirit_level.h"
 
 /*
- * Defining the led matrix device and rows
+ * Defining the led matrix device, its rows are scanned by the driver
  */
 
 #define DM163_NODE DT_NODELABEL(dm163)
 static const struct device *dm163_dev = DEVICE_DT_GET(DM163_NODE);
 
-#define RGB_MATRIX_NODE DT_NODELABEL(rgb_matrix)
-
-BUILD_ASSERT(DT_PROP_LEN(RGB_MATRIX_NODE, rows_gpios) == 8);
-
-static const struct gpio_dt_spec rows[] = {
-    GPIO_DT_SPEC_GET_BY_IDX(RGB_MATRIX_NODE, rows_gpios, 0),
-    GPIO_DT_SPEC_GET_BY_IDX(RGB_MATRIX_NODE, rows_gpios, 1),
-    GPIO_DT_SPEC_GET_BY_IDX(RGB_MATRIX_NODE, rows_gpios, 2),
-    GPIO_DT_SPEC_GET_BY_IDX(RGB_MATRIX_NODE, rows_gpios, 3),
-    GPIO_DT_SPEC_GET_BY_IDX(RGB_MATRIX_NODE, rows_gpios, 4),
-    GPIO_DT_SPEC_GET_BY_IDX(RGB_MATRIX_NODE, rows_gpios, 5),
-    GPIO_DT_SPEC_GET_BY_IDX(RGB_MATRIX_NODE, rows_gpios, 6),
-    GPIO_DT_SPEC_GET_BY_IDX(RGB_MATRIX_NODE, rows_gpios, 7),
-};
+#ifdef CONFIG_DM163_ANIMATION
+// Generated from animations/boot.json
+extern const struct dm163_animation dm163_boot;
+#endif
 
 /*
  * Defining a semaphore to hold the display thread for a time
@@ -39,7 +29,7 @@ K_SEM_DEFINE(display_next_position_sem, 0, 1);
 
 /*
  * Defining a timer allowing the display of the next position FPS times per
- * second by signaling the semaphore periodically
+ * second by signaling the semaphore periodically, while the spirit moves
  */
 struct k_timer next_position_timer;
 
@@ -50,8 +40,19 @@ K_TIMER_DEFINE(next_position_timer, allow_display_next_position, NULL);
 
 k_timeout_t display_next_position_period = K_USEC(1000000 / FPS);
 
-// contains the channels values for the next display
-static uint8_t channels[24];
+/*
+ * Once the spirit has been at rest for IDLE_AFTER_FRAMES, the timer is
+ * stopped and the next position is only computed when new acceleration
+ * measures come in, so that the CPU can idle in between
+ */
+#define IDLE_AFTER_FRAMES (FPS / 2)
+
+static atomic_t display_idle;
+
+static void new_acceleration() {
+  if (atomic_get(&display_idle)) k_sem_give(&display_next_position_sem);
+}
+
 // displays a white led on the position of the spirit level
 static void display_position();
 
@@ -66,26 +67,52 @@ int main() {
 
   configure_accelerometer();
 
-  for (int row = 0; row < 8; row++)
-    gpio_pin_configure_dt(&rows[row], GPIO_OUTPUT_INACTIVE);
-  // Set brightness to 5% for all leds so that we don't become blind
+  // Set brightness to 5% for all leds so that we don't become blind,
+  // shifting out the brightness bank only once
+  dm163_begin_update(dm163_dev);
   for (int i = 0; i < 8; i++) led_set_brightness(dm163_dev, i, 5);
+  dm163_commit(dm163_dev);
+
+#ifdef CONFIG_DM163_ANIMATION
+  // Sweep the matrix before showing the spirit level
+  if (dm163_play_animation(dm163_dev, &dm163_boot) == 0) {
+    while (dm163_animation_playing(dm163_dev)) k_msleep(10);
+  }
+#endif
 
   // Setup the timer to allow the display of a new position periodically
+  set_new_acceleration_handler(new_acceleration);
   k_timer_start(&next_position_timer, K_NO_WAIT, display_next_position_period);
 
   display_position();
 }
 
 static void display_position() {
+  int frames_at_rest = 0;
+  bool displayed = false;
+
   while (1) {
-    if (k_sem_take(&display_next_position_sem, K_FOREVER) == 0) {
-      uint8_t actual_row = update_position_get_spirit_row();
-      update_channels(channels);
+    if (k_sem_take(&display_next_position_sem, K_FOREVER) != 0) continue;
+
+    update_position_get_spirit_row();
+    // only shift out the channels when the spirit reaches another led
+    if (!displayed || spirit_changed_led()) {
+      update_channels(dm163_dev);
+      displayed = true;
+    }
 
-      led_write_channels(dm163_dev, 0, 24, (uint8_t *)&channels);
-      gpio_pin_set_dt(&rows[actual_row], 1);
-      dm163_turn_off_row(dm163_dev, &rows[actual_row]);
+    if (!spirit_at_rest()) {
+      frames_at_rest = 0;
+      // moving again, back to FPS
+      if (atomic_cas(&display_idle, 1, 0)) {
+        k_timer_start(&next_position_timer, display_next_position_period,
+                      display_next_position_period);
+      }
+    } else if (!atomic_get(&display_idle) &&
+               ++frames_at_rest >= IDLE_AFTER_FRAMES) {
+      k_timer_stop(&next_position_timer);
+      k_sem_reset(&display_next_position_sem);
+      atomic_set(&display_idle, 1);
     }
   }
 }
\ No newline at end of file
@@ -0,0 +1,382 @@
+/*
+ * Replay of a recorded accelerometer trace on native_sim: an emulated
+ * LSM6DSL on the I2C emulator pushes the samples of the trace to its FIFO
+ * at their recorded time and raises its INT1 gpio_emul pin, so that the
+ * spirit level runs unchanged, faster than real time.
+ */
+#define DT_DRV_COMPAT spirit_lsm6dsl_replay
+
+#include "replay.h"
+
+#include <string.h>
+#include <time.h>
+#include <zephyr/device.h>
+#include <zephyr/drivers/emul.h>
+#include <zephyr/drivers/gpio.h>
+#include <zephyr/drivers/gpio/gpio_emul.h>
+#include <zephyr/drivers/i2c.h>
+#include <zephyr/drivers/i2c_emul.h>
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/sys/byteorder.h>
+
+#include <posix_board_if.h>
+
+#include "../dm163_module/zephyr/dm163.h"
+#include "../dm163_module/zephyr/dm163_emul.h"
+#include "accel_trace.h"
+
+/*
+ * Registers of the LSM6DSL used by the spirit level
+ */
+#define FIFO_CTRL1 0x06
+#define FIFO_CTRL2 0x07
+#define FIFO_CTRL3 0x08
+#define FIFO_CTRL5 0x0A
+#define INT1_CTRL 0x0D
+#define WHO_AM_I 0x0F
+#define CTRL1_XL 0x10
+#define CTRL3_C 0x12
+#define OUTX_L_XL 0x28
+#define FIFO_STATUS1 0x3A
+#define FIFO_STATUS2 0x3B
+#define FIFO_DATA_OUT_L 0x3E
+#define FIFO_DATA_OUT_H 0x3F
+
+#define REGISTERS 0x80
+#define FIFO_WORDS 2048
+#define FIFO_MODE_CONTINUOUS 0x6
+
+#define REPLAY_STACK_SIZE 1024
+#define REPLAY_PRIORITY 5
+// leave the application the time to configure the accelerometer
+#define REPLAY_START_DELAY_MS 100
+// time given to the pipeline to settle after the last sample
+#define REPLAY_END_DELAY_MS 1000
+
+struct lsm6dsl_replay_config {
+  struct gpio_dt_spec irq;
+};
+
+struct lsm6dsl_replay_data {
+  const struct lsm6dsl_replay_config *config;
+  uint8_t registers[REGISTERS];
+  // words of the FIFO, the X, Y and Z acceleration of each sample
+  uint16_t fifo[FIFO_WORDS];
+  uint16_t fifo_head;
+  uint16_t fifo_level;
+  // the high byte of the FIFO word being read is next
+  bool fifo_high_byte;
+  bool irq_level;
+  // guards the registers and the FIFO against the replay thread
+  struct k_spinlock lock;
+};
+
+static const struct lsm6dsl_replay_config lsm6dsl_replay_config = {
+    .irq = GPIO_DT_SPEC_INST_GET(0, irq_gpios),
+};
+
+static struct lsm6dsl_replay_data lsm6dsl_replay_data = {
+    .config = &lsm6dsl_replay_config,
+};
+
+static void replay_thread(void *p1, void *p2, void *p3);
+
+K_THREAD_DEFINE(replay_thread_id, REPLAY_STACK_SIZE, replay_thread, NULL,
+                NULL, NULL, REPLAY_PRIORITY, 0, REPLAY_START_DELAY_MS);
+
+LOG_MODULE_REGISTER(replay, LOG_LEVEL_INF);
+
+static void reset_registers(struct lsm6dsl_replay_data *data) {
+  memset(data->registers, 0, sizeof(data->registers));
+  data->registers[WHO_AM_I] = 0x6A;
+  // IF_INC: the address is incremented on multiple byte accesses
+  data->registers[CTRL3_C] = 0x04;
+  data->fifo_level = 0;
+  data->fifo_high_byte = false;
+}
+
+static uint16_t watermark(const struct lsm6dsl_replay_data *data) {
+  return data->registers[FIFO_CTRL1] |
+         ((data->registers[FIFO_CTRL2] & 0x7) << 8);
+}
+
+// the FIFO only stores the acceleration, in continuous mode
+static bool fifo_enabled(const struct lsm6dsl_replay_data *data) {
+  return (data->registers[FIFO_CTRL3] & 0x7) == 0x1 &&
+         (data->registers[FIFO_CTRL5] & 0x7) == FIFO_MODE_CONTINUOUS &&
+         (data->registers[FIFO_CTRL5] >> 3) != 0;
+}
+
+static bool fifo_threshold_reached(const struct lsm6dsl_replay_data *data) {
+  return watermark(data) > 0 && data->fifo_level >= watermark(data);
+}
+
+// INT1 follows the FIFO threshold, when it is routed to it
+static void update_irq(struct lsm6dsl_replay_data *data) {
+  bool level = (data->registers[INT1_CTRL] & BIT(3)) &&
+               fifo_threshold_reached(data);
+
+  if (level == data->irq_level) return;
+  data->irq_level = level;
+  gpio_emul_input_set(data->config->irq.port, data->config->irq.pin, level);
+}
+
+static uint8_t read_register(struct lsm6dsl_replay_data *data, uint8_t reg) {
+  switch (reg) {
+    case FIFO_STATUS1:
+      return data->fifo_level & 0xFF;
+    case FIFO_STATUS2:
+      return ((data->fifo_level >> 8) & 0x7) |
+             (fifo_threshold_reached(data) << 7) |
+             ((data->fifo_level == 0) << 4);
+    case FIFO_DATA_OUT_L:
+    case FIFO_DATA_OUT_H: {
+      if (data->fifo_level == 0) return 0;
+
+      uint16_t word = data->fifo[data->fifo_head];
+
+      if (!data->fifo_high_byte) {
+        data->fifo_high_byte = true;
+        return word & 0xFF;
+      }
+      data->fifo_high_byte = false;
+      data->fifo_head = (data->fifo_head + 1) % FIFO_WORDS;
+      data->fifo_level--;
+      return word >> 8;
+    }
+    default:
+      return reg < REGISTERS ? data->registers[reg] : 0;
+  }
+}
+
+static void write_register(struct lsm6dsl_replay_data *data, uint8_t reg,
+                           uint8_t value) {
+  if (reg >= REGISTERS) return;
+
+  if (reg == CTRL3_C && (value & 0x1)) {
+    reset_registers(data);
+    return;
+  }
+  data->registers[reg] = value;
+  // leaving the continuous mode empties the FIFO
+  if (reg == FIFO_CTRL5 && !fifo_enabled(data)) data->fifo_level = 0;
+}
+
+// the address rolls over from the end of FIFO_DATA_OUT to its start
+static uint8_t next_register(uint8_t reg) {
+  return reg == FIFO_DATA_OUT_H ? FIFO_DATA_OUT_L : reg + 1;
+}
+
+static int lsm6dsl_replay_transfer(const struct emul *target,
+                                   struct i2c_msg *msgs, int num_msgs,
+                                   int addr) {
+  struct lsm6dsl_replay_data *data = target->data;
+  k_spinlock_key_t key = k_spin_lock(&data->lock);
+  uint8_t reg = 0;
+
+  for (int i = 0; i < num_msgs; i++) {
+    struct i2c_msg *msg = &msgs[i];
+    uint32_t start = 0;
+
+    if (msg->flags & I2C_MSG_READ) {
+      for (uint32_t j = 0; j < msg->len; j++) {
+        msg->buf[j] = read_register(data, reg);
+        reg = next_register(reg);
+      }
+      continue;
+    }
+    // a write starts with the address of the register
+    if (msg->len > 0) {
+      reg = msg->buf[0];
+      start = 1;
+    }
+    for (uint32_t j = start; j < msg->len; j++) {
+      write_register(data, reg, msg->buf[j]);
+      reg = next_register(reg);
+    }
+  }
+
+  update_irq(data);
+  k_spin_unlock(&data->lock, key);
+  return 0;
+}
+
+static void push_sample(struct lsm6dsl_replay_data *data,
+                        const struct accel_trace_sample *sample) {
+  k_spinlock_key_t key = k_spin_lock(&data->lock);
+
+  for (int i = 0; i < 3; i++) {
+    uint16_t word = sample->acceleration[i];
+
+    sys_put_le16(word, &data->registers[OUTX_L_XL + i * 2]);
+    if (!fifo_enabled(data)) continue;
+
+    // a full FIFO overwrites its oldest words
+    if (data->fifo_level == FIFO_WORDS) {
+      data->fifo_head = (data->fifo_head + 1) % FIFO_WORDS;
+      data->fifo_level--;
+    }
+    data->fifo[(data->fifo_head + data->fifo_level) % FIFO_WORDS] = word;
+    data->fifo_level++;
+  }
+
+  update_irq(data);
+  k_spin_unlock(&data->lock, key);
+}
+
+static int lsm6dsl_replay_init(const struct emul *target,
+                               const struct device *parent) {
+  struct lsm6dsl_replay_data *data = target->data;
+
+  reset_registers(data);
+  return 0;
+}
+
+static int lsm6dsl_replay_device_init(const struct device *dev) { return 0; }
+
+static const struct i2c_emul_api lsm6dsl_replay_api = {
+    .transfer = lsm6dsl_replay_transfer,
+};
+
+// The spirit level talks to the accelerometer on its own, the device is
+// only needed by the emulator.
+DEVICE_DT_INST_DEFINE(0, lsm6dsl_replay_device_init, NULL, NULL, NULL,
+                      POST_KERNEL, CONFIG_I2C_INIT_PRIORITY, NULL);
+
+EMUL_DT_INST_DEFINE(0, lsm6dsl_replay_init, &lsm6dsl_replay_data,
+                    &lsm6dsl_replay_config, &lsm6dsl_replay_api, NULL);
+
+/*
+ * DM163 of the spirit level, and the banks its emulator latched: the
+ * channels of each row of the matrix and the dot correction
+ */
+#define DM163_NODE DT_NODELABEL(dm163)
+#define DM163_COLUMNS (DT_PROP(DM163_NODE, chain_length) * DM163_CHIP_LEDS)
+#define DM163_MATRIX DT_PHANDLE(DM163_NODE, rgb_matrix)
+#define DM163_ROWS                                      \
+  COND_CODE_1(DT_NODE_HAS_PROP(DM163_NODE, rgb_matrix), \
+              (DT_PROP_LEN(DM163_MATRIX, rows_gpios)), (1))
+
+static const struct device *const dm163_dev = DEVICE_DT_GET(DM163_NODE);
+static uint8_t latched_channels[DM163_ROWS * DM163_COLUMNS * 3];
+static uint8_t latched_brightness[DM163_COLUMNS * 3];
+// ",led:rrggbb" per lit led, and the dot correction in hex
+static char frame_line[sizeof(latched_channels) / 3 * 12 +
+                       sizeof(latched_brightness) * 2 + 32];
+
+/*
+ * Host CPU time of each stage, and frames rendered
+ */
+static const char *const stage_names[LATENCY_STAGES] = {
+    "irq", "integrate", "position", "channels", "flush_start", "latch",
+};
+
+static uint64_t stage_start_ns[LATENCY_STAGES];
+static uint64_t stage_ns[LATENCY_STAGES];
+static uint32_t stage_calls[LATENCY_STAGES];
+static uint32_t frames;
+
+/*
+ * Dump of the frames latched by the emulator. When scanning, the latch
+ * hook is called once the first row of a frame is latched, so the dump
+ * waits for its other rows, half a row period before the scan may pick up
+ * a newer frame.
+ */
+#if DT_NODE_HAS_PROP(DM163_NODE, rgb_matrix)
+#define ROW_PERIOD_US \
+  (USEC_PER_SEC / (CONFIG_DM163_SCAN_REFRESH_RATE * DM163_ROWS))
+#define LATCH_TO_DUMP \
+  K_USEC(ROW_PERIOD_US * (DM163_ROWS - 1) + ROW_PERIOD_US / 2)
+#else
+#define LATCH_TO_DUMP K_NO_WAIT
+#endif
+
+static void dump_latched(struct k_work *work);
+
+static K_WORK_DELAYABLE_DEFINE(dump_work, dump_latched);
+static atomic_t latched_seq;
+
+static uint64_t host_cpu_ns() {
+  struct timespec now;
+
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+  return (uint64_t)now.tv_sec * NSEC_PER_SEC + now.tv_nsec;
+}
+
+void replay_stage_begin(enum latency_stage stage) {
+  stage_start_ns[stage] = host_cpu_ns();
+}
+
+void replay_stage_end(enum latency_stage stage) {
+  stage_ns[stage] += host_cpu_ns() - stage_start_ns[stage];
+  stage_calls[stage]++;
+}
+
+/*
+ * The leds lit by the latched channels, as led:rrggbb in the order of the
+ * LED API, and the dot correction bank
+ */
+static void format_latched(char *line, size_t size) {
+  int len = 0;
+
+  if (dm163_emul_get_channels(dm163_dev, latched_channels,
+                              sizeof(latched_channels)) ||
+      dm163_emul_get_brightness(dm163_dev, latched_brightness,
+                                sizeof(latched_brightness))) {
+    snprintk(line, size, " latched=none");
+    return;
+  }
+
+  len += snprintk(line + len, size - len, " lit=");
+  for (int led = 0; led < sizeof(latched_channels) / 3; led++) {
+    const uint8_t *rgb = &latched_channels[led * 3];
+
+    if (!rgb[0] && !rgb[1] && !rgb[2]) continue;
+    len += snprintk(line + len, size - len, "%s%d:%02x%02x%02x",
+                    line[len - 1] == '=' ? "" : ",", led, rgb[0], rgb[1],
+                    rgb[2]);
+  }
+  len += snprintk(line + len, size - len, " brightness=");
+  for (int i = 0; i < sizeof(latched_brightness); i++) {
+    len += snprintk(line + len, size - len, "%02x", latched_brightness[i]);
+  }
+}
+
+void replay_frame() { frames++; }
+
+static void dump_latched(struct k_work *work) {
+  format_latched(frame_line, sizeof(frame_line));
+  printk("replay frame t_ms=%lld seq=%u%s\n", (long long)k_uptime_get(),
+         (uint32_t)atomic_get(&latched_seq), frame_line);
+}
+
+void replay_latch(const struct device *dev, uint32_t seq) {
+  if (dev != dm163_dev) return;
+  atomic_set(&latched_seq, seq);
+  k_work_reschedule(&dump_work, LATCH_TO_DUMP);
+}
+
+static void replay_thread(void *p1, void *p2, void *p3) {
+  int64_t start_ms = k_uptime_get();
+
+  LOG_INF("replaying %zu samples", accel_trace_len);
+  for (size_t i = 0; i < accel_trace_len; i++) {
+    const struct accel_trace_sample *sample = &accel_trace[i];
+
+    k_sleep(K_TIMEOUT_ABS_US(start_ms * USEC_PER_MSEC + sample->t_us));
+    push_sample(&lsm6dsl_replay_data, sample);
+  }
+  k_msleep(REPLAY_END_DELAY_MS);
+
+  // one line per stage, as key=value pairs
+  printk("replay done samples=%zu frames=%u\n", accel_trace_len, frames);
+  for (int stage = 0; stage < LATENCY_STAGES; stage++) {
+    if (stage_calls[stage] == 0) continue;
+    printk("replay stage=%s calls=%u cpu_us=%llu avg_ns=%llu\n",
+           stage_names[stage], stage_calls[stage],
+           (unsigned long long)(stage_ns[stage] / NSEC_PER_USEC),
+           (unsigned long long)(stage_ns[stage] / stage_calls[stage]));
+  }
+  posix_exit(0);
+}
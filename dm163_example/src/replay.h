@@ -0,0 +1,29 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <inttypes.h>
+#include <zephyr/device.h>
+
+#include "latency.h"
+
+#ifdef CONFIG_SPIRIT_LEVEL_REPLAY
+/*
+ * Measure the host CPU time spent in a stage of the pipeline, the
+ * simulated time of native_sim not moving while code runs
+ */
+void replay_stage_begin(enum latency_stage stage);
+void replay_stage_end(enum latency_stage stage);
+
+// count a frame rendered, which is dumped once the DM163 has latched it
+void replay_frame();
+
+// dump the frame seq once the scan has latched all its rows
+void replay_latch(const struct device *dev, uint32_t seq);
+#else
+#define replay_stage_begin(stage)
+#define replay_stage_end(stage)
+#define replay_frame()
+#define replay_latch(dev, seq)
+#endif
+
+#endif
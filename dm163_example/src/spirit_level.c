@@ -3,8 +3,15 @@
 #include <zephyr/device.h>
 #include <zephyr/drivers/gpio.h>
 #include <zephyr/drivers/i2c.h>
+#include <zephyr/drivers/led.h>
 #include <zephyr/kernel.h>
 #include <zephyr/logging/log.h>
+#include <zephyr/rtio/rtio.h>
+
+#include "../dm163_module/zephyr/dm163.h"
+#include "latency.h"
+#include "replay.h"
+#include "spirit_physics.h"
 
 /*
  * Defining the accelerometer
@@ -17,17 +24,24 @@ static struct i2c_dt_spec accelerometer_i2c =
 static const struct gpio_dt_spec accelerometer_irq_gpio =
     GPIO_DT_SPEC_GET(ACCELEROMETER_NODE, irq_gpios);
 
-#define ACCELEROMETER_ODR 52
-
 /*
- * Linear acceleration register address and values
+ * FIFO of the accelerometer, holding the X, Y and Z acceleration of each
+ * sample as three 16-bit words
  */
-static uint8_t acceleration_register_address = 0x28;
-static int16_t acceleration_measure[2];
-static uint8_t acceleration_register[4];
+#define FIFO_SAMPLE_WORDS 3
+#define FIFO_SAMPLE_SIZE (FIFO_SAMPLE_WORDS * 2)
+#define FIFO_WATERMARK_WORDS \
+  (CONFIG_SPIRIT_LEVEL_FIFO_WATERMARK * FIFO_SAMPLE_WORDS)
+
+static uint8_t fifo_status_register_address = 0x3A;
+static uint8_t fifo_data_register_address = 0x3E;
+static uint8_t fifo_status_register[2];
+// Reading more than the watermark catches up with a late work item.
+static uint8_t fifo_data[2 * CONFIG_SPIRIT_LEVEL_FIFO_WATERMARK *
+                         FIFO_SAMPLE_SIZE];
 
 /*
- * Accelerometer new data ready
+ * Accelerometer FIFO watermark reached
  */
 
 // interrupt data
@@ -35,19 +49,32 @@ static struct gpio_callback acceleration_isr_data;
 // update velocity job
 static struct k_work update_velocity_job;
 
+// 2.999...9 is rounded to 2 and 4.000..1 is rounded to 4
+// so 3.5 is the mean of the values rounded to 3
+// only accessed by the render loop
+static struct PrecisePosition precise_position = {SPIRIT_CONST(3.5),
+                                                  SPIRIT_CONST(3.5), 0, 0};
+
 /*
- * Creating a PrecisePosition struct
+ * Sums of the acceleration measures since boot, written by the sensor path
+ * and read by the render loop, which applies their change since the
+ * previous frame to the velocity.
+ * They are guarded by a seqlock: the writer never waits, and the reader
+ * copies them again if a write happened meanwhile. There is a single
+ * writer, the RTIO completions or the system workqueue depending on
+ * CONFIG_I2C_RTIO, which masks the interrupts for the few instructions of
+ * a write so that the render loop can never preempt it in the middle of it.
  */
-struct PrecisePosition {
-  double x;
-  double y;
-  double v_x;
-  double v_y;
+struct AccelerationSums {
+  // odd while a write is in progress
+  atomic_t seq;
+  int64_t x;
+  int64_t y;
 };
 
-// 2.999...9 is rounded to 2 and 4.000..1 is rounded to 4
-// so 3.5 is the mean of the values rounded to 3
-static struct PrecisePosition precise_position = {3.5, 3.5, 0, 0};
+static struct AccelerationSums acceleration_sums;
+
+static void (*new_acceleration_handler)();
 
 /*
  * The precise position is approximated on the led matrix by
@@ -56,92 +83,308 @@ static struct PrecisePosition precise_position = {3.5, 3.5, 0, 0};
 uint8_t actual_position[2];
 uint8_t previous_position[2];
 
-uint8_t approximate_on_led_matrix(double value);
+uint8_t approximate_on_led_matrix(spirit_t value);
 
 LOG_MODULE_REGISTER(spirit_level, LOG_LEVEL_INF);
 
-// update the velocity of the spirit from the acceleration
+/*
+ * Number of whole samples to read from the FIFO, from the number of unread
+ * words in FIFO_STATUS1 and bits [2:0] of FIFO_STATUS2
+ */
+static uint16_t fifo_samples() {
+  uint16_t words =
+      fifo_status_register[0] | ((fifo_status_register[1] & 0x7) << 8);
+
+  return MIN(words / FIFO_SAMPLE_WORDS, sizeof(fifo_data) / FIFO_SAMPLE_SIZE);
+}
+
+// sum the acceleration measures of a batch, then publish them
+static void integrate_batch(uint16_t samples) {
+  int32_t acceleration_sum[2] = {0, 0};
+
+  latency_trace(LATENCY_I2C_DONE);
+  replay_stage_begin(LATENCY_I2C_DONE);
+
+  for (int s = 0; s < samples; s++) {
+    const uint8_t *sample = &fifo_data[s * FIFO_SAMPLE_SIZE];
+
+    for (int i = 0; i < 2; i++) {
+      uint16_t acceleration = sample[i * 2] | (sample[i * 2 + 1] << 8);
+      acceleration_sum[i] += (int16_t)acceleration;
+    }
+  }
+
+  unsigned int key = irq_lock();
+
+  atomic_inc(&acceleration_sums.seq);
+  compiler_barrier();
+  acceleration_sums.x += acceleration_sum[0];
+  acceleration_sums.y += acceleration_sum[1];
+  compiler_barrier();
+  atomic_inc(&acceleration_sums.seq);
+  irq_unlock(key);
+
+  replay_stage_end(LATENCY_I2C_DONE);
+
+  if (new_acceleration_handler) new_acceleration_handler();
+
+  LOG_DBG("%u samples, accel x %d ; accel y %d\n", samples,
+          acceleration_sum[0], acceleration_sum[1]);
+}
+
+// get a consistent copy of the acceleration sums
+static void read_acceleration_sums(int64_t *x, int64_t *y) {
+  atomic_val_t seq;
+
+  do {
+    seq = atomic_get(&acceleration_sums.seq);
+    compiler_barrier();
+    *x = acceleration_sums.x;
+    *y = acceleration_sums.y;
+    compiler_barrier();
+  } while ((seq & 1) || atomic_get(&acceleration_sums.seq) != seq);
+}
+
+// add the acceleration of the new samples to the sums
 void update_velocity() {
-  // read the accelerometer registers and update the velocity
+  // drain the FIFO as long as it is above the watermark
   while (gpio_pin_get_dt(&accelerometer_irq_gpio)) {
-    // read the contents of the 4 needed acceleration registers
-    // put their contents in a buffer
-    i2c_write_read_dt(&accelerometer_i2c, &acceleration_register_address, 1,
-                      acceleration_register, 4);
+    if (i2c_write_read_dt(&accelerometer_i2c, &fifo_status_register_address,
+                          1, fifo_status_register, 2)) {
+      LOG_ERR("Couldn't read the FIFO status\n");
+      return;
+    }
+    uint16_t samples = fifo_samples();
 
-    // get the acceleration measures from register contents
-    for (int i = 0; i < 2; i++) {
-      uint16_t acceleration = acceleration_register[i * 2] |
-                              (acceleration_register[i * 2 + 1] << 8);
-      acceleration_measure[i] = (int16_t)acceleration;
+    if (samples == 0) return;
+
+    // read the whole batch at once, the address rolling over from the end
+    // of FIFO_DATA_OUT to its start
+    if (i2c_write_read_dt(&accelerometer_i2c, &fifo_data_register_address, 1,
+                          fifo_data, samples * FIFO_SAMPLE_SIZE)) {
+      LOG_ERR("Couldn't read the FIFO\n");
+      return;
     }
+    integrate_batch(samples);
+  }
+}
+
+#ifdef CONFIG_I2C_RTIO
+/*
+ * Asynchronous draining of the FIFO through RTIO: the interrupt handler
+ * submits the read of the FIFO status, whose completion submits the read of
+ * the batch, whose completion integrates it. No thread of the application
+ * waits on the bus. Buses without RTIO support of their own, such as the
+ * I2C emulator, run the same transfers from the RTIO work queue.
+ */
+I2C_DT_IODEV_DEFINE(accelerometer_iodev, ACCELEROMETER_NODE);
+// a read and its callback, plus the callback submitting it
+RTIO_DEFINE(accelerometer_rtio, 4, 4);
+
+enum drain_state { DRAIN_IDLE, DRAIN_READING, DRAIN_FAILED };
+
+static atomic_t drain_state;
+static uint16_t batch_samples;
+// serializes the consumers of the completions of accelerometer_rtio
+static struct k_spinlock completions_lock;
+
+/*
+ * A failed transfer cancels the callback chained to it, so the watchdog
+ * notices the reads which never complete, and retries a failed drain after
+ * a while rather than hammering a failing bus
+ */
+#define DRAIN_TIMEOUT K_MSEC(100)
+
+static void drain_timeout(struct k_timer *timer);
+
+K_TIMER_DEFINE(drain_watchdog, drain_timeout, NULL);
+
+static void end_drain(int ret);
+static void fifo_status_read(struct rtio *r, const struct rtio_sqe *sqe,
+                             void *arg0);
+static void fifo_data_read(struct rtio *r, const struct rtio_sqe *sqe,
+                           void *arg0);
+
+// consume the completions of the transfers and return the first error
+static int reap_completions() {
+  k_spinlock_key_t key = k_spin_lock(&completions_lock);
+  struct rtio_cqe *cqe;
+  int ret = 0;
+
+  while ((cqe = rtio_cqe_consume(&accelerometer_rtio))) {
+    if (cqe->result < 0 && !ret) ret = cqe->result;
+    rtio_cqe_release(&accelerometer_rtio, cqe);
+  }
+  k_spin_unlock(&completions_lock, key);
+  return ret;
+}
+
+// write the register address then read len bytes, and call callback
+static int read_async(uint8_t *address, uint8_t *buf, uint32_t len,
+                      rtio_callback_t callback) {
+  struct rtio_sqe *write = rtio_sqe_acquire(&accelerometer_rtio);
+  struct rtio_sqe *read = rtio_sqe_acquire(&accelerometer_rtio);
+  struct rtio_sqe *done = rtio_sqe_acquire(&accelerometer_rtio);
+
+  if (!write || !read || !done) {
+    rtio_sqe_drop_all(&accelerometer_rtio);
+    return -ENOMEM;
+  }
+
+  rtio_sqe_prep_tiny_write(write, &accelerometer_iodev, RTIO_PRIO_NORM,
+                           address, 1, NULL);
+  write->flags |= RTIO_SQE_TRANSACTION;
+  rtio_sqe_prep_read(read, &accelerometer_iodev, RTIO_PRIO_NORM, buf, len,
+                     NULL);
+  read->iodev_flags |= RTIO_IODEV_I2C_RESTART | RTIO_IODEV_I2C_STOP;
+  read->flags |= RTIO_SQE_CHAINED;
+  rtio_sqe_prep_callback(done, callback, NULL, NULL);
+
+  k_timer_start(&drain_watchdog, DRAIN_TIMEOUT, K_NO_WAIT);
+  return rtio_submit(&accelerometer_rtio, 0);
+}
+
+static void start_drain() {
+  int ret;
+
+  if (!atomic_cas(&drain_state, DRAIN_IDLE, DRAIN_READING)) return;
+
+  ret = read_async(&fifo_status_register_address, fifo_status_register, 2,
+                   fifo_status_read);
+  if (ret) end_drain(ret);
+}
+
+/*
+ * A failed drain is only retried by the watchdog, so that a single read is
+ * ever in flight and only this path writes the FIFO buffers and the sums
+ */
+static void end_drain(int ret) {
+  if (ret) {
+    LOG_WRN("Asynchronous FIFO read failed (%d)", ret);
+    atomic_set(&drain_state, DRAIN_FAILED);
+    k_timer_start(&drain_watchdog, DRAIN_TIMEOUT, K_NO_WAIT);
+    return;
+  }
+
+  k_timer_stop(&drain_watchdog);
+  atomic_set(&drain_state, DRAIN_IDLE);
+  // the watermark may have been reached again without a new edge
+  if (gpio_pin_get_dt(&accelerometer_irq_gpio)) start_drain();
+}
+
+static void drain_timeout(struct k_timer *timer) {
+  // a read whose completions show no error is still in flight
+  if (atomic_get(&drain_state) == DRAIN_READING && !reap_completions()) {
+    k_timer_start(&drain_watchdog, DRAIN_TIMEOUT, K_NO_WAIT);
+    return;
+  }
+
+  atomic_set(&drain_state, DRAIN_IDLE);
+  if (gpio_pin_get_dt(&accelerometer_irq_gpio)) start_drain();
+}
+
+static void fifo_status_read(struct rtio *r, const struct rtio_sqe *sqe,
+                             void *arg0) {
+  int ret = reap_completions();
+
+  if (ret) {
+    end_drain(ret);
+    return;
+  }
+
+  batch_samples = fifo_samples();
+  if (batch_samples == 0) {
+    end_drain(0);
+    return;
+  }
+
+  ret = read_async(&fifo_data_register_address, fifo_data,
+                   batch_samples * FIFO_SAMPLE_SIZE, fifo_data_read);
+  if (ret) end_drain(ret);
+}
+
+static void fifo_data_read(struct rtio *r, const struct rtio_sqe *sqe,
+                           void *arg0) {
+  int ret = reap_completions();
 
-    // update velocity using acceleration
-    // acc
-    precise_position.v_x -= (double)(acceleration_measure[1]) /
-                            ACCELEROMETER_ODR / ACCELERATION_DIVIDER;
-    precise_position.v_y -= (double)(acceleration_measure[0]) /
-                            ACCELEROMETER_ODR / ACCELERATION_DIVIDER;
-
-    LOG_DBG("accel x %hd ; accel y %hd\n", acceleration_measure[0],
-            acceleration_measure[1]);
-    LOG_DBG("from accel : v_x %g ; v_y %g\n\n", precise_position.v_x,
-            precise_position.v_y);
+  if (ret) {
+    end_drain(ret);
+    return;
   }
+
+  integrate_batch(batch_samples);
+  end_drain(0);
 }
+#endif
 
 /*
  * Takes a value in [0, 8] and outputs an uint8_t between 0 and 7 included
  */
-uint8_t approximate_on_led_matrix(double value) {
-  return ((uint8_t)value == 8) ? 7 : (uint8_t)value;
+uint8_t approximate_on_led_matrix(spirit_t value) {
+  uint8_t led = SPIRIT_TO_INT(value);
+
+  return (led == 8) ? 7 : led;
 }
 
 // update the position of the spirit from the velocity
 uint8_t update_position_get_spirit_row() {
+  static int64_t previous_sums[2];
+  int64_t sums[2];
+
+  replay_stage_begin(LATENCY_POSITION);
   previous_position[0] = approximate_on_led_matrix(precise_position.x);
   previous_position[1] = approximate_on_led_matrix(precise_position.y);
 
-  precise_position.x += precise_position.v_x / FPS;
-  precise_position.y += precise_position.v_y / FPS;
-
-  /*
-   * In case the spirit level reached the side of the board,
-   * the position and velocity needs to be adapted
-   */
-  if (precise_position.x > 8) {
-    precise_position.v_x -= (precise_position.x - 8) * FPS;
-    precise_position.x = 8;
-  } else if (precise_position.x < 0) {
-    precise_position.v_x -= precise_position.x * FPS;
-    precise_position.x = 0;
-  }
-
-  if (precise_position.y > 8) {
-    precise_position.v_y -= (precise_position.y - 8) * FPS;
-    precise_position.y = 8;
-  } else if (precise_position.y < 0) {
-    precise_position.v_y -= precise_position.y * FPS;
-    precise_position.y = 0;
-  }
+  // update velocity using the acceleration measured since the last frame,
+  // the y axis of the accelerometer being along the x axis of the matrix
+  read_acceleration_sums(&sums[0], &sums[1]);
+  spirit_step(&precise_position, (int32_t)(sums[1] - previous_sums[1]),
+              (int32_t)(sums[0] - previous_sums[0]));
+  previous_sums[0] = sums[0];
+  previous_sums[1] = sums[1];
 
   actual_position[0] = approximate_on_led_matrix(precise_position.x);
   actual_position[1] = approximate_on_led_matrix(precise_position.y);
+  latency_trace(LATENCY_POSITION);
+  replay_stage_end(LATENCY_POSITION);
 
-  LOG_DBG("x %g ; y %g\n\n", precise_position.x, precise_position.y);
-  LOG_DBG("v_x %g ; v_y %g\n\n", precise_position.v_x, precise_position.v_y);
+  LOG_DBG("x %g ; y %g\n\n", SPIRIT_TO_DOUBLE(precise_position.x),
+          SPIRIT_TO_DOUBLE(precise_position.y));
+  LOG_DBG("v_x %g ; v_y %g\n\n", SPIRIT_TO_DOUBLE(precise_position.v_x),
+          SPIRIT_TO_DOUBLE(precise_position.v_y));
 
   return actual_position[1];
 }
 
-void update_channels(uint8_t channels[24]) {
-  channels[3 * previous_position[0]] = 0;
-  channels[3 * previous_position[0] + 1] = 0;
-  channels[3 * previous_position[0] + 2] = 0;
+bool spirit_changed_led() {
+  return actual_position[0] != previous_position[0] ||
+         actual_position[1] != previous_position[1];
+}
+
+bool spirit_at_rest() {
+  spirit_t rest = SPIRIT_CONST(REST_VELOCITY);
 
-  channels[3 * actual_position[0]] = 255;
-  channels[3 * actual_position[0] + 1] = 255;
-  channels[3 * actual_position[0] + 2] = 255;
+  return precise_position.v_x < rest && precise_position.v_x > -rest &&
+         precise_position.v_y < rest && precise_position.v_y > -rest;
+}
+
+void set_new_acceleration_handler(void (*handler)()) {
+  new_acceleration_handler = handler;
+}
+
+/*
+ * Turns off the led of the previous position and turns on the led of the
+ * actual one, the leds of the matrix being numbered row after row
+ */
+void update_channels(const struct device *led_matrix) {
+  latency_trace(LATENCY_CHANNELS);
+  replay_stage_begin(LATENCY_CHANNELS);
+  dm163_begin_update(led_matrix);
+  led_off(led_matrix, previous_position[1] * 8 + previous_position[0]);
+  led_on(led_matrix, actual_position[1] * 8 + actual_position[0]);
+  dm163_commit(led_matrix);
+  replay_stage_end(LATENCY_CHANNELS);
+  replay_frame();
 }
 
 /*
@@ -149,7 +392,12 @@ void update_channels(uint8_t channels[24]) {
  */
 static void acceleration_isr(const struct device *dev, struct gpio_callback *cb,
                              uint32_t pins) {
+  latency_trace(LATENCY_IRQ);
+#ifdef CONFIG_I2C_RTIO
+  start_drain();
+#else
   k_work_submit(&update_velocity_job);
+#endif
 }
 
 void configure_accelerometer() {
@@ -165,16 +413,33 @@ void configure_accelerometer() {
   value = 1 << 4;
   i2c_reg_update_byte_dt(&accelerometer_i2c, 0x15, bit_mask, value);
 
-  // set output data rate of accelerometer at 52Hz
-  // set bits [7:4] of register 10 (CTRL1_XL) to 0011
+  // set output data rate of accelerometer
+  // set bits [7:4] of register 10 (CTRL1_XL) to the ODR bits
   bit_mask = 0xF << 4;
-  value = 0x3 << 4;
+  value = CONFIG_SPIRIT_LEVEL_ACCEL_ODR_BITS << 4;
   i2c_reg_update_byte_dt(&accelerometer_i2c, 0x10, bit_mask, value);
 
-  // allowing the interruption Accelerometer Data Ready on INT1
-  // set bit 0 of register 0D (INT1_CTRL) to 1
-  bit_mask = 1;
-  value = 1;
+  // set the FIFO watermark, in words
+  // bits [7:0] in register 06 (FIFO_CTRL1), [10:8] in register 07
+  // (FIFO_CTRL2)
+  i2c_reg_write_byte_dt(&accelerometer_i2c, 0x06, FIFO_WATERMARK_WORDS & 0xFF);
+  i2c_reg_update_byte_dt(&accelerometer_i2c, 0x07, 0x7,
+                         FIFO_WATERMARK_WORDS >> 8);
+
+  // only store the acceleration in the FIFO, without decimation
+  // set register 08 (FIFO_CTRL3) to 00000001
+  i2c_reg_write_byte_dt(&accelerometer_i2c, 0x08, 0x1);
+
+  // fill the FIFO at the accelerometer ODR, in continuous mode
+  // set bits [6:3] of register 0A (FIFO_CTRL5) to the ODR bits and
+  // bits [2:0] to 110
+  i2c_reg_write_byte_dt(&accelerometer_i2c, 0x0A,
+                        (CONFIG_SPIRIT_LEVEL_ACCEL_ODR_BITS << 3) | 0x6);
+
+  // allowing the interruption FIFO threshold on INT1
+  // set bit 3 of register 0D (INT1_CTRL) to 1
+  bit_mask = 1 << 3;
+  value = 1 << 3;
   i2c_reg_update_byte_dt(&accelerometer_i2c, 0x0D, bit_mask, value);
 }
 
@@ -214,7 +479,8 @@ int setup_accelerometer_irq() {
 
   /*
    * Initializing a workqueue job to execute the blocking I2C
-   * operation to read the acceleration and update the velocity
+   * operations to drain the FIFO and update the velocity, when the
+   * reads are not done through RTIO
    */
   k_work_init(&update_velocity_job, update_velocity);
 
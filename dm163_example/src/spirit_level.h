@@ -2,15 +2,30 @@
 #define SPIRIT_LEVEL_H
 
 #include <inttypes.h>
+#include <zephyr/device.h>
 
+// highest rate at which the spirit moves and is displayed
 #define FPS 60
 // the acceleration is divided by this coefficient so it's not too high
 #define ACCELERATION_DIVIDER 50
+// below this speed, in leds per second, the spirit is considered at rest
+#define REST_VELOCITY 0.5
 
 uint8_t update_position_get_spirit_row();
-void update_channels(uint8_t channels[24]);
+void update_channels(const struct device *led_matrix);
 void update_velocity();
 
+// whether the last update moved the spirit to another led
+bool spirit_changed_led();
+// whether the spirit is slower than REST_VELOCITY
+bool spirit_at_rest();
+
+/*
+ * Set a function called by the sensor path, possibly from an interrupt,
+ * each time new acceleration measures are available
+ */
+void set_new_acceleration_handler(void (*handler)());
+
 void configure_accelerometer();
 int setup_accelerometer_irq();
 
@@ -0,0 +1,108 @@
+#ifndef SPIRIT_PHYSICS_H
+#define SPIRIT_PHYSICS_H
+
+#include <inttypes.h>
+
+#include "spirit_level.h"
+
+/*
+ * Arithmetic of the physics, chosen with CONFIG_SPIRIT_LEVEL_MATH unless
+ * SPIRIT_MATH_Q16_16, SPIRIT_MATH_FLOAT or SPIRIT_MATH_DOUBLE is defined
+ * before including this header, as the tests comparing them do.
+ * The divisions by constants are done as multiplications by their
+ * reciprocal, except with doubles which keep the original model.
+ */
+#if !defined(SPIRIT_MATH_Q16_16) && !defined(SPIRIT_MATH_FLOAT) && \
+    !defined(SPIRIT_MATH_DOUBLE)
+#if defined(CONFIG_SPIRIT_LEVEL_MATH_Q16_16)
+#define SPIRIT_MATH_Q16_16
+#elif defined(CONFIG_SPIRIT_LEVEL_MATH_FLOAT)
+#define SPIRIT_MATH_FLOAT
+#else
+#define SPIRIT_MATH_DOUBLE
+#endif
+#endif
+
+#define ACCELEROMETER_ODR CONFIG_SPIRIT_LEVEL_ACCEL_ODR
+#define ACCELERATION_SCALE (ACCELEROMETER_ODR * ACCELERATION_DIVIDER)
+
+#if defined(SPIRIT_MATH_Q16_16)
+typedef int32_t spirit_t;
+#define SPIRIT_FRACTION_BITS 16
+#define SPIRIT_CONST(x) ((spirit_t)((x) * (1 << SPIRIT_FRACTION_BITS)))
+#define SPIRIT_TO_INT(v) ((v) >> SPIRIT_FRACTION_BITS)
+#define SPIRIT_TO_DOUBLE(v) ((double)(v) / (1 << SPIRIT_FRACTION_BITS))
+// Reciprocals in Q0.32, the products being computed on 64 bits
+#define ACCELERATION_RECIPROCAL ((int64_t)((1ULL << 32) / ACCELERATION_SCALE))
+#define FPS_RECIPROCAL ((int64_t)((1ULL << 32) / FPS))
+#define SPIRIT_FROM_ACCELERATION(a) \
+  ((spirit_t)(((a) * ACCELERATION_RECIPROCAL) >> (32 - SPIRIT_FRACTION_BITS)))
+// Rounded to nearest, as truncating would slow down the spirit each frame
+#define SPIRIT_PER_FRAME(v) \
+  ((spirit_t)(((v) * FPS_RECIPROCAL + (1LL << 31)) >> 32))
+#elif defined(SPIRIT_MATH_FLOAT)
+typedef float spirit_t;
+#define SPIRIT_CONST(x) ((float)(x))
+#define SPIRIT_TO_INT(v) ((int32_t)(v))
+#define SPIRIT_TO_DOUBLE(v) ((double)(v))
+#define SPIRIT_FROM_ACCELERATION(a) ((a) * (1.0f / ACCELERATION_SCALE))
+#define SPIRIT_PER_FRAME(v) ((v) * (1.0f / FPS))
+#else
+typedef double spirit_t;
+#define SPIRIT_CONST(x) (x)
+#define SPIRIT_TO_INT(v) ((int32_t)(v))
+#define SPIRIT_TO_DOUBLE(v) (v)
+#define SPIRIT_FROM_ACCELERATION(a) \
+  ((double)(a) / ACCELEROMETER_ODR / ACCELERATION_DIVIDER)
+#define SPIRIT_PER_FRAME(v) ((v) / FPS)
+#endif
+
+// Side of the led matrix
+#define SPIRIT_MAX SPIRIT_CONST(8)
+
+/*
+ * Creating a PrecisePosition struct
+ */
+struct PrecisePosition {
+  spirit_t x;
+  spirit_t y;
+  spirit_t v_x;
+  spirit_t v_y;
+};
+
+/*
+ * Move the spirit by one frame, after slowing it down by the sums of the
+ * acceleration measured along the x and y axes of the matrix since the
+ * previous frame
+ */
+static inline void spirit_step(struct PrecisePosition *position,
+                               int32_t acceleration_x,
+                               int32_t acceleration_y) {
+  position->v_x -= SPIRIT_FROM_ACCELERATION(acceleration_x);
+  position->v_y -= SPIRIT_FROM_ACCELERATION(acceleration_y);
+
+  position->x += SPIRIT_PER_FRAME(position->v_x);
+  position->y += SPIRIT_PER_FRAME(position->v_y);
+
+  /*
+   * In case the spirit level reached the side of the board,
+   * the position and velocity needs to be adapted
+   */
+  if (position->x > SPIRIT_MAX) {
+    position->v_x -= (position->x - SPIRIT_MAX) * FPS;
+    position->x = SPIRIT_MAX;
+  } else if (position->x < 0) {
+    position->v_x -= position->x * FPS;
+    position->x = 0;
+  }
+
+  if (position->y > SPIRIT_MAX) {
+    position->v_y -= (position->y - SPIRIT_MAX) * FPS;
+    position->y = SPIRIT_MAX;
+  } else if (position->y < 0) {
+    position->v_y -= position->y * FPS;
+    position->y = 0;
+  }
+}
+
+#endif
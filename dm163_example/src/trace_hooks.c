@@ -0,0 +1,18 @@
+/*
+ * Hooks of the DM163 flushes, shared by the latency tracing and the dump
+ * of the replayed frames
+ */
+#include <zephyr/device.h>
+
+#include "../dm163_module/zephyr/dm163.h"
+#include "latency.h"
+#include "replay.h"
+
+void dm163_trace_flush_start(const struct device *dev, uint32_t seq) {
+  latency_trace(LATENCY_FLUSH_START);
+}
+
+void dm163_trace_latch(const struct device *dev, uint32_t seq) {
+  latency_trace(LATENCY_LATCH);
+  replay_latch(dev, seq);
+}
@@ -0,0 +1,73 @@
+/*
+ * Comparison of the arithmetics of CONFIG_SPIRIT_LEVEL_MATH: the physics
+ * of the spirit run in Q16.16, float and double through the same
+ * acceleration, and the positions of each frame must stay within a
+ * tolerance of the double ones. Each arithmetic prints a key=value line
+ * with the cycles spent in spirit_step(), which only advance with the
+ * simulated time on native_sim and are meaningful on the board.
+ */
+#include <zephyr/kernel.h>
+#include <zephyr/ztest.h>
+
+#include "spirit_run.h"
+
+// 20 s of frames
+#define FRAMES 1200
+
+// Position errors allowed against double, in leds
+#define Q16_16_TOLERANCE (1.0 / 64)
+#define FLOAT_TOLERANCE (1.0 / 1024)
+
+static int32_t acceleration[FRAMES][2];
+static double reference[FRAMES][2];
+static double positions[FRAMES][2];
+
+/*
+ * Sums of acceleration of a tilt alternating between both sides of each
+ * axis, with a ripple, so that the spirit travels and hits the sides
+ */
+static void generate_acceleration() {
+  for (int f = 0; f < FRAMES; f++) {
+    acceleration[f][0] = ((f / 90) % 2 ? 900 : -700) + (f % 7) * 13;
+    acceleration[f][1] = ((f / 150) % 2 ? -1100 : 800) - (f % 5) * 17;
+  }
+}
+
+static void print_run(const char *name, uint32_t cycles, double max_error) {
+  TC_PRINT("spirit_math name=%s frames=%u cycles=%u cycles_per_frame=%u "
+           "max_error_uleds=%u\n",
+           name, FRAMES, cycles, cycles / FRAMES,
+           (uint32_t)(max_error * 1000000));
+}
+
+// Run the physics and return the largest error of a position
+static double run(const char *name, spirit_run_t spirit_run) {
+  uint32_t cycles = spirit_run(acceleration, FRAMES, positions);
+  double max_error = 0;
+
+  for (int f = 0; f < FRAMES; f++) {
+    for (int i = 0; i < 2; i++) {
+      double error = positions[f][i] - reference[f][i];
+
+      if (error < 0) error = -error;
+      if (error > max_error) max_error = error;
+    }
+  }
+  print_run(name, cycles, max_error);
+  return max_error;
+}
+
+ZTEST(spirit_math, test_formats_agree) {
+  uint32_t cycles;
+
+  generate_acceleration();
+  cycles = spirit_run_double(acceleration, FRAMES, reference);
+  print_run("double", cycles, 0);
+
+  zassert_true(run("float", spirit_run_float) <= FLOAT_TOLERANCE,
+               "float diverged from double");
+  zassert_true(run("q16_16", spirit_run_q16_16) <= Q16_16_TOLERANCE,
+               "Q16.16 diverged from double");
+}
+
+ZTEST_SUITE(spirit_math, NULL, NULL, NULL, NULL, NULL);
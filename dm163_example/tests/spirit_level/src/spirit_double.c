@@ -0,0 +1,3 @@
+#define SPIRIT_MATH_DOUBLE
+#define SPIRIT_RUN spirit_run_double
+#include "spirit_run.inc"
@@ -0,0 +1,3 @@
+#define SPIRIT_MATH_FLOAT
+#define SPIRIT_RUN spirit_run_float
+#include "spirit_run.inc"
@@ -0,0 +1,3 @@
+#define SPIRIT_MATH_Q16_16
+#define SPIRIT_RUN spirit_run_q16_16
+#include "spirit_run.inc"
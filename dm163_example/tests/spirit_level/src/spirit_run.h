@@ -0,0 +1,22 @@
+#ifndef SPIRIT_RUN_H
+#define SPIRIT_RUN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Move the spirit from the center of the matrix through the sums of
+ * acceleration of each frame, storing its position after each one.
+ * Return the cycles spent in spirit_step(), over all the frames.
+ */
+typedef uint32_t (*spirit_run_t)(const int32_t (*acceleration)[2],
+                                 size_t frames, double (*positions)[2]);
+
+uint32_t spirit_run_q16_16(const int32_t (*acceleration)[2], size_t frames,
+                           double (*positions)[2]);
+uint32_t spirit_run_float(const int32_t (*acceleration)[2], size_t frames,
+                          double (*positions)[2]);
+uint32_t spirit_run_double(const int32_t (*acceleration)[2], size_t frames,
+                           double (*positions)[2]);
+
+#endif
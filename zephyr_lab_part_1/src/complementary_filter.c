@@ -13,7 +13,14 @@
 #include "blink_leds.h"
 
 #define MSGQ_BUFFER_SIZE 1
-#define MSGQ_UPDATE_PERIOD K_MSEC(MSGQ_CHECK_PERIOD_MS)
+
+/*
+ * The blink decision is taken at CONFIG_TILT_DECISION_RATE Hz from the
+ * latest board tilt, in degrees, whatever the rate of the sensor stage
+ */
+#define DECISION_PERIOD K_MSEC(MSEC_PER_SEC / CONFIG_TILT_DECISION_RATE)
+
+static atomic_t board_tilt_degrees;
 
 #define LED_THREAD_STACK_SIZE 512
 #define LED_THREAD_PRIORITY 15
@@ -36,16 +43,13 @@ static blink_half_period_ms_t get_blink_half_period_from_measure(
     int board_tilt);
 static void update_msgq_if_necessary(blink_half_period_ms_t new_blink_period);
 static void send_message();
+static void decide_blink_period(struct k_timer *timer);
 
-protected_variable tilt_from_acceleration;
-protected_variable tilt_change_from_gyroscope;
+K_TIMER_DEFINE(decision_timer, decide_blink_period, NULL);
 
 LOG_MODULE_REGISTER(complementary_filter, LOG_LEVEL_INF);
 
 void init_complementary_filter() {
-  k_mutex_init(&tilt_from_acceleration.mutex);
-  k_mutex_init(&tilt_change_from_gyroscope.mutex);
-
   // Initializing the message queue
   k_msgq_init(&blink_period_msgq, blink_period_msgq_buffer,
               sizeof(blink_half_period_ms_t), MSGQ_BUFFER_SIZE);
@@ -54,25 +58,28 @@ void init_complementary_filter() {
   k_thread_create(&led_thread, led_thread_stack, LED_THREAD_STACK_SIZE,
                   led_main, NULL, NULL, NULL, LED_THREAD_PRIORITY, 0,
                   K_NO_WAIT);
+
+  k_timer_start(&decision_timer, DECISION_PERIOD, DECISION_PERIOD);
 }
-void compute_board_attitude_with_filter() {
-  static double complementary_coefficient = 0.98;
-  static double tilt = 0;
 
-  k_mutex_lock(&tilt_change_from_gyroscope.mutex, K_FOREVER);
-  tilt = tilt_change_from_gyroscope.value * (1 - complementary_coefficient);
-  k_mutex_unlock(&tilt_change_from_gyroscope.mutex);
+void fuse_board_tilt(double tilt_from_acceleration,
+                     double tilt_change_from_gyroscope) {
+  static double complementary_coefficient = 0.98;
+  double tilt = tilt_change_from_gyroscope * (1 - complementary_coefficient);
 
   LOG_DBG("after gyro : %g\n", tilt);
 
-  k_mutex_lock(&tilt_from_acceleration.mutex, K_FOREVER);
-  tilt += tilt_from_acceleration.value * complementary_coefficient;
-  k_mutex_unlock(&tilt_from_acceleration.mutex);
+  tilt += tilt_from_acceleration * complementary_coefficient;
 
   LOG_DBG("%g\n", tilt * 180 / 3.1415926535);
 
+  // the decision only needs whole degrees, which are written atomically
+  atomic_set(&board_tilt_degrees, (int)(tilt * 180 / 3.1415926535));
+}
+
+static void decide_blink_period(struct k_timer *timer) {
   blink_half_period_ms_t blink_period =
-      get_blink_half_period_from_measure((int)(tilt * 180 / 3.1415926535));
+      get_blink_half_period_from_measure(atomic_get(&board_tilt_degrees));
   update_msgq_if_necessary(blink_period);
 }
 
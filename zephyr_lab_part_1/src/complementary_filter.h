@@ -1,12 +1,10 @@
 #include <zephyr/kernel.h>
 
-typedef struct {
-  struct k_mutex mutex;
-  volatile double value;
-} protected_variable;
-
-extern protected_variable tilt_from_acceleration;
-extern protected_variable tilt_change_from_gyroscope;
-
-void compute_board_attitude_with_filter();
-void init_complementary_filter();
\ No newline at end of file
+/*
+ * Fuse the tilts computed from the accelerometer and the gyroscope, in
+ * radians, into the board tilt. Called by the sensor stage for each
+ * batch, from the RTIO completions when the sensor is read through RTIO.
+ */
+void fuse_board_tilt(double tilt_from_acceleration,
+                     double tilt_change_from_gyroscope);
+void init_complementary_filter();
@@ -7,6 +7,7 @@
 #include <zephyr/drivers/i2c.h>
 #include <zephyr/kernel.h>
 #include <zephyr/logging/log.h>
+#include <zephyr/rtio/rtio.h>
 #include <zephyr/sys/util.h>
 #include <zephyr/sys_clock.h>
 
@@ -19,83 +20,284 @@ extern struct i2c_dt_spec accelerometer_i2c;
 extern const struct gpio_dt_spec accelerometer_irq_gpio;
 
 /*
- * Workqueue job to compute the tilt
+ * FIFO of the gyroscope, holding the X, Y and Z angular rate of each
+ * sample, and its status registers 3A (FIFO_STATUS1) and 3B (FIFO_STATUS2)
  */
-static struct k_work compute_tilt_job;
+#define FIFO_SAMPLE_WORDS 3
+#define FIFO_SAMPLE_SIZE (FIFO_SAMPLE_WORDS * 2)
+
+static uint8_t fifo_status_register_address = 0x3A;
+static uint8_t fifo_data_register_address = 0x3E;
+static uint8_t fifo_status_register[2];
+// room for twice the watermark, in case the FIFO filled up in the meantime
+static uint8_t fifo_data[2 * CONFIG_TILT_GYRO_FIFO_WATERMARK *
+                         FIFO_SAMPLE_SIZE];
 
 /*
- * Linear acceleration register address and values
+ * Linear acceleration register address and values, read once per batch
  */
 static uint8_t acceleration_register_address = 0x28;
-static int16_t acceleration_measure[3];
 static uint8_t acceleration_register[6];
+static int16_t acceleration_measure[3];
 
 /*
- * Angular rate register address and values
+ * I2C transactions done since the last report, which is logged every
+ * BUS_RATE_PERIOD_S seconds
  */
-static uint8_t angular_rate_register_address = 0x22;
-static uint8_t angular_rate_register[4];
-static int16_t angular_rate_measure[2];
+#define BUS_RATE_PERIOD_S 10
 
-/*
- * Initializing a workqueue thread to compute the tilt
- * using a complementary filter
- */
-#define MY_STACK_SIZE 512
-#define MY_PRIORITY 13
+static atomic_t bus_transactions;
 
-K_THREAD_STACK_DEFINE(compute_tilt_stack_area, MY_STACK_SIZE);
+static void report_bus_rate(struct k_timer *timer);
 
-static struct k_work_q compute_tilt_workq;
+K_TIMER_DEFINE(bus_rate_timer, report_bus_rate, NULL);
 
 void handle_new_data();
-void init_filter_workq();
-static void compute_board_tilt_from_acceleration();
-static void compute_board_tilt_from_angular_rate();
+void init_filter();
+static uint16_t fifo_samples();
+static void compute_board_tilt_from_batch(uint16_t samples);
+static double compute_board_tilt_from_acceleration();
+static double compute_board_tilt_from_angular_rate(uint16_t samples);
 
 LOG_MODULE_REGISTER(accelerometer_data, CONFIG_LOG_DEFAULT_LEVEL);
 
-void init_filter_workq() {
+void init_filter() {
   /*
-   * Initializing a workqueue job to compute the tilt
-   * using a complementary filter
+   * Initializing the complementary filter, which takes the blink decision
+   * at its own rate from the tilts fused by the sensor stage
    */
   init_complementary_filter();
 
-  k_work_init(&compute_tilt_job, compute_board_attitude_with_filter);
+  k_timer_start(&bus_rate_timer, K_SECONDS(BUS_RATE_PERIOD_S),
+                K_SECONDS(BUS_RATE_PERIOD_S));
+}
 
-  k_work_queue_init(&compute_tilt_workq);
+static void report_bus_rate(struct k_timer *timer) {
+  atomic_val_t transactions = atomic_set(&bus_transactions, 0);
 
-  k_work_queue_start(&compute_tilt_workq, compute_tilt_stack_area,
-                     K_THREAD_STACK_SIZEOF(compute_tilt_stack_area),
-                     MY_PRIORITY, NULL);
+  LOG_INF("%ld I2C transactions/s", (long)transactions / BUS_RATE_PERIOD_S);
 }
 
 void handle_new_data() {
+  // drain the FIFO as long as it is above the watermark
   while (gpio_pin_get_dt(&accelerometer_irq_gpio)) {
-    // read the status register 1E (STATUS_REG)
-    // bit 0 : Accelerometer New Data
-    // bit 1 : Gyroscope New Data
-    uint8_t status_reg;
-    i2c_reg_read_byte_dt(&accelerometer_i2c, 0x1E, &status_reg);
-
-    if (status_reg & 0x1) {
-      compute_board_tilt_from_acceleration();
-    }
+    if (i2c_write_read_dt(&accelerometer_i2c, &fifo_status_register_address,
+                          1, fifo_status_register, 2))
+      return;
+    atomic_inc(&bus_transactions);
 
-    if (status_reg & 0x2) {
-      compute_board_tilt_from_angular_rate();
-    }
-    k_work_submit_to_queue(&compute_tilt_workq, &compute_tilt_job);
+    uint16_t samples = fifo_samples();
+
+    if (samples == 0) return;
+
+    // read the whole batch at once, the address rolling over from the end
+    // of FIFO_DATA_OUT to its start, then the latest acceleration
+    if (i2c_write_read_dt(&accelerometer_i2c, &fifo_data_register_address, 1,
+                          fifo_data, samples * FIFO_SAMPLE_SIZE) ||
+        i2c_write_read_dt(&accelerometer_i2c, &acceleration_register_address,
+                          1, acceleration_register, 6))
+      return;
+    atomic_add(&bus_transactions, 2);
+
+    compute_board_tilt_from_batch(samples);
   }
 }
 
-static void compute_board_tilt_from_acceleration() {
-  // read the contents of all 6 acceleration registers
-  // put their contents in a buffer
-  i2c_write_read_dt(&accelerometer_i2c, &acceleration_register_address, 1,
-                    acceleration_register, 6);
+#ifdef CONFIG_I2C_RTIO
+/*
+ * Asynchronous reads through RTIO: the interrupt handler submits the read
+ * of the FIFO status, whose completion submits the read of the batch, whose
+ * completion submits the read of the acceleration, whose completion
+ * computes the tilt. No thread of the application waits on the bus. Buses
+ * without RTIO support of their own run the same transfers from the RTIO
+ * work queue.
+ */
+I2C_DT_IODEV_DEFINE(accelerometer_iodev, DT_ALIAS(accel0));
+// a read and its callback, plus the callback submitting it
+RTIO_DEFINE(accelerometer_rtio, 4, 4);
+
+enum read_state { READ_IDLE, READ_READING, READ_FAILED };
+
+static atomic_t read_state;
+static uint16_t batch_samples;
+// serializes the consumers of the completions of accelerometer_rtio
+static struct k_spinlock completions_lock;
+
+/*
+ * A failed transfer cancels the callback chained to it, so the watchdog
+ * notices the reads which never complete, and retries a failed read after
+ * a while rather than hammering a failing bus
+ */
+#define READ_TIMEOUT K_MSEC(100)
+
+static void read_timeout(struct k_timer *timer);
+
+K_TIMER_DEFINE(read_watchdog, read_timeout, NULL);
+
+static void end_read(int ret);
+static void fifo_status_read(struct rtio *r, const struct rtio_sqe *sqe,
+                             void *arg0);
+static void fifo_data_read(struct rtio *r, const struct rtio_sqe *sqe,
+                           void *arg0);
+static void acceleration_read(struct rtio *r, const struct rtio_sqe *sqe,
+                              void *arg0);
+
+// consume the completions of the transfers and return the first error
+static int reap_completions() {
+  k_spinlock_key_t key = k_spin_lock(&completions_lock);
+  struct rtio_cqe *cqe;
+  int ret = 0;
+
+  while ((cqe = rtio_cqe_consume(&accelerometer_rtio))) {
+    if (cqe->result < 0 && !ret) ret = cqe->result;
+    rtio_cqe_release(&accelerometer_rtio, cqe);
+  }
+  k_spin_unlock(&completions_lock, key);
+  return ret;
+}
+
+// write the register address then read len bytes, and call callback
+static int read_async(uint8_t *address, uint8_t *buf, uint32_t len,
+                      rtio_callback_t callback) {
+  struct rtio_sqe *write = rtio_sqe_acquire(&accelerometer_rtio);
+  struct rtio_sqe *read = rtio_sqe_acquire(&accelerometer_rtio);
+  struct rtio_sqe *done = rtio_sqe_acquire(&accelerometer_rtio);
+
+  if (!write || !read || !done) {
+    rtio_sqe_drop_all(&accelerometer_rtio);
+    return -ENOMEM;
+  }
+
+  rtio_sqe_prep_tiny_write(write, &accelerometer_iodev, RTIO_PRIO_NORM,
+                           address, 1, NULL);
+  write->flags |= RTIO_SQE_TRANSACTION;
+  rtio_sqe_prep_read(read, &accelerometer_iodev, RTIO_PRIO_NORM, buf, len,
+                     NULL);
+  read->iodev_flags |= RTIO_IODEV_I2C_RESTART | RTIO_IODEV_I2C_STOP;
+  read->flags |= RTIO_SQE_CHAINED;
+  rtio_sqe_prep_callback(done, callback, NULL, NULL);
+
+  k_timer_start(&read_watchdog, READ_TIMEOUT, K_NO_WAIT);
+  return rtio_submit(&accelerometer_rtio, 0);
+}
+
+/*
+ * A failed read is only retried by the watchdog, so that a single read is
+ * ever in flight and only this path writes the buffers and the angles
+ */
+static void end_read(int ret) {
+  if (ret) {
+    LOG_WRN("Asynchronous read failed (%d)", ret);
+    atomic_set(&read_state, READ_FAILED);
+    k_timer_start(&read_watchdog, READ_TIMEOUT, K_NO_WAIT);
+    return;
+  }
+
+  k_timer_stop(&read_watchdog);
+  atomic_set(&read_state, READ_IDLE);
+  // the watermark may have been reached again without a new edge
+  if (gpio_pin_get_dt(&accelerometer_irq_gpio)) start_new_data_read();
+}
+
+static void read_timeout(struct k_timer *timer) {
+  // a read whose completions show no error is still in flight
+  if (atomic_get(&read_state) == READ_READING && !reap_completions()) {
+    k_timer_start(&read_watchdog, READ_TIMEOUT, K_NO_WAIT);
+    return;
+  }
 
+  atomic_set(&read_state, READ_IDLE);
+  if (gpio_pin_get_dt(&accelerometer_irq_gpio)) start_new_data_read();
+}
+
+int start_new_data_read() {
+  int ret;
+
+  if (!atomic_cas(&read_state, READ_IDLE, READ_READING)) return 0;
+
+  ret = read_async(&fifo_status_register_address, fifo_status_register, 2,
+                   fifo_status_read);
+  if (ret) end_read(ret);
+  return 0;
+}
+
+static void fifo_status_read(struct rtio *r, const struct rtio_sqe *sqe,
+                             void *arg0) {
+  int ret = reap_completions();
+
+  if (ret) {
+    end_read(ret);
+    return;
+  }
+  atomic_inc(&bus_transactions);
+
+  batch_samples = fifo_samples();
+  if (batch_samples == 0) {
+    end_read(0);
+    return;
+  }
+
+  ret = read_async(&fifo_data_register_address, fifo_data,
+                   batch_samples * FIFO_SAMPLE_SIZE, fifo_data_read);
+  if (ret) end_read(ret);
+}
+
+static void fifo_data_read(struct rtio *r, const struct rtio_sqe *sqe,
+                           void *arg0) {
+  int ret = reap_completions();
+
+  if (ret) {
+    end_read(ret);
+    return;
+  }
+  atomic_inc(&bus_transactions);
+
+  ret = read_async(&acceleration_register_address, acceleration_register, 6,
+                   acceleration_read);
+  if (ret) end_read(ret);
+}
+
+static void acceleration_read(struct rtio *r, const struct rtio_sqe *sqe,
+                              void *arg0) {
+  int ret = reap_completions();
+
+  if (ret) {
+    end_read(ret);
+    return;
+  }
+  atomic_inc(&bus_transactions);
+
+  compute_board_tilt_from_batch(batch_samples);
+  end_read(0);
+}
+#else
+int start_new_data_read() { return -ENOSYS; }
+#endif
+
+/*
+ * Number of whole samples to read from the FIFO, from the number of unread
+ * words in FIFO_STATUS1 and bits [2:0] of FIFO_STATUS2
+ */
+static uint16_t fifo_samples() {
+  uint16_t words =
+      fifo_status_register[0] | ((fifo_status_register[1] & 0x7) << 8);
+
+  return MIN(words / FIFO_SAMPLE_WORDS, sizeof(fifo_data) / FIFO_SAMPLE_SIZE);
+}
+
+/*
+ * Integrate every angular rate sample of the batch, compute the tilt from
+ * the acceleration once, then fuse them right away.
+ */
+static void compute_board_tilt_from_batch(uint16_t samples) {
+  double tilt_change_from_gyroscope =
+      compute_board_tilt_from_angular_rate(samples);
+
+  fuse_board_tilt(compute_board_tilt_from_acceleration(),
+                  tilt_change_from_gyroscope);
+}
+
+static double compute_board_tilt_from_acceleration() {
   // get the acceleration measures from register contents
   for (int i = 0; i < 3; i++) {
     uint16_t acceleration =
@@ -108,37 +310,28 @@ static void compute_board_tilt_from_acceleration() {
 
   double g_xy = sqrt(g_xy_squared);
   // compute the attitude
-  double tilt_angle = atan2(g_xy, g_z);
-
-  k_mutex_lock(&tilt_from_acceleration.mutex, K_FOREVER);
-  tilt_from_acceleration.value = tilt_angle;
-  k_mutex_unlock(&tilt_from_acceleration.mutex);
+  return atan2(g_xy, g_z);
 }
 
-static void compute_board_tilt_from_angular_rate() {
+static double compute_board_tilt_from_angular_rate(uint16_t samples) {
   static double angle[2] = {0, 0};
+  int16_t angular_rate_measure[2];
 
-  // read the contents of the 4 needed angular rate registers
-  // put their contents in a buffer
-  i2c_write_read_dt(&accelerometer_i2c, &angular_rate_register_address, 1,
-                    angular_rate_register, 4);
-
-  // integrate the angular rate
-  for (int i = 0; i < 2; i++) {
-    uint16_t angular_rate =
-        angular_rate_register[i * 2] | (angular_rate_register[i * 2 + 1] << 8);
-    angular_rate_measure[i] = (int16_t)angular_rate;
-
-    // the scale of the measure is +/- 250 dps, the frequency is GYROSCOPE_ODR
-    // Hz
-    angle[i] += (float)(angular_rate_measure[i]) / (1 << 15) * 250 /
-                GYROSCOPE_ODR / 180 * 3.1415926535;
-  }
-  LOG_DBG("(Rate measures %hd %hd)\n", angular_rate_measure[0],
-          angular_rate_measure[1]);
-  double board_tilt = acos(cos(angle[0]) * cos(angle[1]));
+  // integrate the angular rate of every sample of the batch
+  for (int s = 0; s < samples; s++) {
+    const uint8_t *sample = &fifo_data[s * FIFO_SAMPLE_SIZE];
+
+    for (int i = 0; i < 2; i++) {
+      uint16_t angular_rate = sample[i * 2] | (sample[i * 2 + 1] << 8);
+      angular_rate_measure[i] = (int16_t)angular_rate;
 
-  k_mutex_lock(&tilt_change_from_gyroscope.mutex, K_FOREVER);
-  tilt_change_from_gyroscope.value = board_tilt;
-  k_mutex_unlock(&tilt_change_from_gyroscope.mutex);
+      // the scale of the measure is +/- 250 dps, the frequency is
+      // GYROSCOPE_ODR Hz
+      angle[i] += (float)(angular_rate_measure[i]) / (1 << 15) * 250 /
+                  GYROSCOPE_ODR / 180 * 3.1415926535;
+    }
+  }
+  LOG_DBG("(%u samples, last rate measures %hd %hd)\n", samples,
+          angular_rate_measure[0], angular_rate_measure[1]);
+  return acos(cos(angle[0]) * cos(angle[1]));
 }
\ No newline at end of file
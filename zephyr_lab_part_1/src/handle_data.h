@@ -4,8 +4,20 @@
 #define ACCELEROMETER_ODR 52
 #define GYROSCOPE_ODR 1660
 
+// FIFO watermark, in 16-bit words, each gyroscope sample taking 3 of them
+#define FIFO_WATERMARK_WORDS (CONFIG_TILT_GYRO_FIFO_WATERMARK * 3)
+
 extern void handle_new_data();
 
-extern void init_filter_workq();
+/*
+ * Start reading the new data with asynchronous I2C transfers through RTIO.
+ * Return -ENOSYS without CONFIG_I2C_RTIO, the data having then to be read
+ * by handle_new_data() from a thread.
+ */
+extern int start_new_data_read();
+
+extern void handle_new_data_from_workq();
+
+extern void init_filter();
 
 #endif
\ No newline at end of file
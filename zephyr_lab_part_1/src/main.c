@@ -63,10 +63,15 @@ int main(void) {
 
 /*
  * Accelerometer Interrupt Handler
- * Submit a handle new data job to the workqueue
+ * Start reading the new data asynchronously, or submit a handle new data
+ * job to the workqueue
  */
 static void sensor_isr(const struct device *dev, struct gpio_callback *cb,
                        uint32_t pins) {
+  if (start_new_data_read() == -ENOSYS) handle_new_data_from_workq();
+}
+
+void handle_new_data_from_workq() {
   k_work_submit_to_queue(&handle_data_workq, &handle_data_job);
 }
 
@@ -101,10 +106,26 @@ static void configure_accelerometer() {
   value = 0x8 << 4;
   i2c_reg_update_byte_dt(&accelerometer_i2c, 0x11, bit_mask, value);
 
-  // allowing the interruption Accelerometer Data Ready on INT1
-  // set bit 0 of register 0D (INT1_CTRL) to 1
-  bit_mask = 0x3;
-  value = 0x3;
+  // set the FIFO watermark, in words
+  // bits [7:0] in register 06 (FIFO_CTRL1), [10:8] in register 07
+  // (FIFO_CTRL2)
+  i2c_reg_write_byte_dt(&accelerometer_i2c, 0x06, FIFO_WATERMARK_WORDS & 0xFF);
+  i2c_reg_update_byte_dt(&accelerometer_i2c, 0x07, 0x7,
+                         FIFO_WATERMARK_WORDS >> 8);
+
+  // only store the angular rate in the FIFO, without decimation
+  // set register 08 (FIFO_CTRL3) to 00001000
+  i2c_reg_write_byte_dt(&accelerometer_i2c, 0x08, 0x1 << 3);
+
+  // fill the FIFO at GYROSCOPE_ODR Hz, in continuous mode
+  // set bits [6:3] of register 0A (FIFO_CTRL5) to 1000 and bits [2:0] to 110
+  i2c_reg_write_byte_dt(&accelerometer_i2c, 0x0A, (0x8 << 3) | 0x6);
+
+  // allowing the interruption FIFO threshold on INT1, instead of the data
+  // ready ones
+  // set bit 3 of register 0D (INT1_CTRL) to 1 and bits [1:0] to 00
+  bit_mask = (1 << 3) | 0x3;
+  value = 1 << 3;
   i2c_reg_update_byte_dt(&accelerometer_i2c, 0x0D, bit_mask, value);
 }
 
@@ -140,7 +161,8 @@ static int setup_gpio_irq_and_workqueues() {
 
   /*
    * Initializing a workqueue job to execute the blocking I2C
-   * operation to handle the new data
+   * operation to handle the new data, when it cannot be read
+   * asynchronously
    */
   k_work_init(&handle_data_job, handle_new_data);
 
@@ -150,7 +172,7 @@ static int setup_gpio_irq_and_workqueues() {
                      K_THREAD_STACK_SIZEOF(handle_data_stack_area), MY_PRIORITY,
                      NULL);
 
-  init_filter_workq();
+  init_filter();
 
   LOG_INF("Irq & workqueues setup was successful\n");
   return 1;